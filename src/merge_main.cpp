@@ -0,0 +1,89 @@
+#include "renderer/raytracer/checkpoint.h"
+#include "renderer/raytracer/denoiser.h"
+#include "resource.h"
+#include "utils/error_handler.h"
+#include "utils/resource_utils.h"
+
+#include <algorithm>
+#include <cxxopts.hpp>
+#include <iostream>
+
+using namespace cg::renderer;
+
+// Puts together the checkpoints of Raytracing processes that traced crops or sample ranges of the same frame
+int main(int argc, char** argv)
+{
+	try
+	{
+		cxxopts::Options options(argv[0], "Merges raytracing checkpoints into a single image");
+		options.positional_help("<checkpoint>...");
+
+		auto add_options = options.add_options();
+		add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
+		add_options("hdr_export_path", "Exports the linear HDR result as a PFM file", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+		add_options("checkpoint_path", "Saves the merged checkpoint, to resume or merge it further", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+		add_options("denoise", "Filters the result with the denoiser, the parts must have been traced with --denoise", cxxopts::value<bool>()->default_value("false"));
+		add_options("parts", "Checkpoints to merge", cxxopts::value<std::vector<std::string>>());
+		add_options("h,help", "Print usage");
+		options.parse_positional({ "parts" });
+
+		auto result = options.parse(argc, argv);
+		if (result.count("help") || !result.count("parts"))
+		{
+			THROW_ERROR(options.help());
+		}
+
+		std::vector<checkpoint> parts;
+		for (const std::string& part : result["parts"].as<std::vector<std::string>>()) {
+			parts.push_back(load_checkpoint(part));
+		}
+		// the samples of every pixel are put together from the first indices on
+		std::stable_sort(parts.begin(), parts.end(), [](const checkpoint& a, const checkpoint& b) { return a.header.sample_begin < b.header.sample_begin; });
+
+		checkpoint merged;
+		std::vector<checkpoint_header> merged_parts;
+		for (const checkpoint& part : parts) {
+			merge_checkpoint(merged, part, merged_parts);
+		}
+
+		size_t width = merged.header.width;
+		size_t height = merged.header.height;
+		cg::resource<accumulator> history(width, height);
+		cg::resource<features> feature_buffer(width, height);
+		size_t sample_count = 0;
+		for (size_t i = 0; i < history.get_number_of_elements(); i++) {
+			history.item(i) = merged.accumulators[i];
+			if (merged.header.has_features) feature_buffer.item(i) = merged.feature_buffer[i];
+			sample_count += merged.accumulators[i].count;
+		}
+		std::cout << "Merged " << merged_parts.size() << " parts, " << static_cast<float>(sample_count) / (width * height)
+				  << " samples per pixel on average\n";
+
+		std::vector<float3> radiance(width * height);
+		for (size_t i = 0; i < radiance.size(); i++) radiance[i] = history.item(i).mean;
+		if (result["denoise"].as<bool>()) {
+			if (!merged.header.has_features) THROW_ERROR("The parts have no feature buffers to denoise with");
+			PRINT_EXECUTION_TIME("Denoise time", denoiser(width, height).denoise(history, feature_buffer, radiance););
+		}
+
+		cg::resource<cg::ucolor> render_target(width, height);
+		cg::resource<cg::fcolor> hdr_target(width, height);
+		for (size_t i = 0; i < radiance.size(); i++) {
+			hdr_target.item(i) = max(radiance[i], float3{ 0.f });
+			render_target.item(i) = cg::from_fcolor(sqrt(hdr_target.item(i)));
+		}
+
+		cg::utils::save_resource(render_target, result["result_path"].as<std::filesystem::path>());
+		std::filesystem::path hdr_result_path = result["hdr_export_path"].as<std::filesystem::path>();
+		if (hdr_result_path != "~~~~~~~~~~") cg::utils::save_resource(hdr_target, hdr_result_path);
+		std::filesystem::path checkpoint_path = result["checkpoint_path"].as<std::filesystem::path>();
+		if (checkpoint_path != "~~~~~~~~~~") save_checkpoint(merged, checkpoint_path);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -2,11 +2,14 @@
 
 #include "resource.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <limits>
 #include <memory>
+#include <vector>
 
 
 using namespace linalg::aliases;
@@ -15,6 +18,35 @@ static constexpr float DEFAULT_DEPTH = std::numeric_limits<float>::max();
 
 namespace cg::renderer
 {
+	// The triangle seen at a pixel: the draw that drew it, and its index among the triangles of that draw
+	struct visibility
+	{
+		static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+		uint32_t draw_id = none;
+		uint32_t triangle_id = none;
+	};
+
+	// What `draw_clusters` did with the clusters of every instance
+	struct cluster_statistics
+	{
+		size_t drawn = 0;
+		size_t outside_view = 0;
+		size_t back_facing = 0;
+		size_t occluded = 0;
+		size_t occluded_triangles = 0;
+	};
+
+	inline cluster_statistics& operator+=(cluster_statistics& statistics, const cluster_statistics& other)
+	{
+		statistics.drawn += other.drawn;
+		statistics.outside_view += other.outside_view;
+		statistics.back_facing += other.back_facing;
+		statistics.occluded += other.occluded;
+		statistics.occluded_triangles += other.occluded_triangles;
+		return statistics;
+	}
+
 	template<typename VB, typename RT>
 	class rasterizer
 	{
@@ -26,28 +58,139 @@ namespace cg::renderer
 				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
 		void clear_render_target(
 				const RT& in_clear_value, const float in_depth = DEFAULT_DEPTH);
+		// Adds a render target that is written wherever the main one is, by its own shader from the same
+		// interpolated vertex, and with the draw and the triangle that the pixel sees, numbering the draws
+		// from the last clear. Every output of the frame comes out of one pass over the triangles. The
+		// pixels that no triangle covers keep `in_clear_value`
+		void add_render_target(
+				std::shared_ptr<resource<cg::fcolor>> in_render_target,
+				std::function<cg::fcolor(const VB& vertex_data, void* data, const visibility& seen)> in_pixel_shader,
+				cg::fcolor in_clear_value = cg::fcolor{ 0.f });
+
+		// With a visibility buffer, `draw` only rasterizes the depth and the (draw id, triangle id) of the
+		// pixels, numbering the draws from the last clear, and `resolve` shades the visible ones afterwards
+		void set_visibility_buffer(std::shared_ptr<resource<visibility>> in_visibility_buffer);
 
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+		// Transforms of the instances drawn by `draw_instanced`
+		void set_instance_buffer(std::shared_ptr<resource<float4x4>> in_instance_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		// The rectangle (x, y, width, height) of the pixels that `draw_visibility` writes, the whole
+		// viewport after `set_viewport`
+		void set_scissor(uint4 in_scissor);
+		// Where the camera is in the world, for `draw_clusters` to cull the clusters that face away from it
+		void set_view_position(float3 in_view_position);
 
 		void draw(size_t num_vertexes, size_t vertex_offset, void* data);
+		// Shades every pixel of the visibility buffer once, in parallel, with the buffers, vertex shader
+		// and data of the draw that it saw. The attributes are interpolated as `draw` does it
+		void resolve();
+		// Draws the triangles once per instance with `instance_vertex_shader`. Every vertex the draw uses is
+		// transformed once per instance, however many triangles share it, and an instance whose bounds
+		// are outside of the view, or behind the occluders, is skipped before any of that. Returns the
+		// number of instances drawn
+		size_t draw_instanced(size_t num_vertexes, size_t vertex_offset, void* data);
+		// Draws the clusters of the index buffer once per instance as `draw_instanced` draws its triangles,
+		// but first skips every cluster whose bounding sphere is outside of the view or whose normal cone
+		// faces away from the view position. Only the vertices of the remaining clusters are transformed.
+		// The instance transforms may rotate, translate and scale, but not by different factors per axis
+		cluster_statistics draw_clusters(const std::vector<cg::cluster>& clusters, void* data);
+		// Draws the clusters as `draw_clusters` does, but only into the depth buffer. Nothing is interpolated
+		// or shaded, so that the vertices need nothing but a position
+		cluster_statistics draw_clusters_depth(const std::vector<cg::cluster>& clusters);
+		// Rasterizes the clusters of the index buffer that are in view and cover a large part of it, once per
+		// instance, into a depth buffer of a quarter of the resolution. A texel only takes the depth of a
+		// triangle that covers all of its pixels, the farthest one, so that what is behind it is surely
+		// hidden. Returns the number of cluster instances drawn as occluders
+		size_t draw_occluders(const std::vector<cg::cluster>& clusters);
+		// Builds the levels of the farthest depth of every 2x2 texels over the occluders, that
+		// `draw_clusters` then tests the clusters against until the next clear
+		void build_occlusion_pyramid();
+		// Rasterizes only the depth and the visibility of the triangles, for `draw_id`: no attributes are
+		// interpolated and no pixel shader runs. Unlike `draw`, triangles are clipped by the near plane
+		// and both of their faces are kept, so that every pixel sees what a ray through it would hit.
+		// The depth is reversed, 1 on the near plane where z = w and 0 on the far one, the greater depth
+		// winning, so the depth buffer is cleared to 0
+		void draw_visibility(size_t num_vertexes, size_t vertex_offset, uint32_t draw_id);
 
 		std::function<VB(VB vertex_data)> vertex_shader;
+		// The vertex shader of `draw_instanced`, given the transform of the instance. Culling runs it on the
+		// corners of the bounds, so its position has to depend on nothing but the input position
+		std::function<VB(VB vertex_data, const float4x4& instance_transform)> instance_vertex_shader;
 		std::function<cg::fcolor(const VB& vertex_data, void* data)> pixel_shader;
 
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
 		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+		std::shared_ptr<cg::resource<float4x4>> instance_buffer;
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<visibility>> visibility_buffer;
+
+		// What `resolve` needs of every draw since the last clear
+		struct deferred_draw
+		{
+			std::shared_ptr<cg::resource<VB>> vertex_buffer;
+			std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+			size_t vertex_offset;
+			std::function<VB(VB vertex_data)> vertex_shader;
+			void* data;
+		};
+		std::vector<deferred_draw> deferred_draws;
+		uint32_t draw_count = 0;
+
+		struct extra_render_target
+		{
+			std::shared_ptr<cg::resource<cg::fcolor>> render_target;
+			std::function<cg::fcolor(const VB& vertex_data, void* data, const visibility& seen)> pixel_shader;
+			cg::fcolor clear_value;
+		};
+		std::vector<extra_render_target> extra_render_targets;
 
 		size_t width = 1920;
 		size_t height = 1080;
+		uint4 scissor { 0, 0, 1920, 1080 };
+		float3 view_position { 0.f };
+
+		// Pixels per side of a texel of the occluder depth. An occluder covers this much of the view at least,
+		// and this many texels per triangle, as smaller triangles hardly ever cover a whole texel
+		static constexpr size_t occlusion_texel_size = 4;
+		static constexpr float occluder_view_fraction = 1.f / 64;
+		static constexpr float occluder_texels_per_triangle = 16;
+		// The occluder depth and the levels above it, the pyramid only being used once it is built
+		std::vector<cg::resource<float>> occlusion_pyramid;
+		bool is_occlusion_pyramid_built = false;
 
 		float edge_function(float2 a, float2 b, float2 c);
+		// The vertices are the triangle after the vertex shader and the perspective division, and
+		// `edge2`, `edge3`, `edge1` the weights of its first, second and third vertex
+		float4 interpolate_position(const VB* vertices, float edge1, float edge2, float edge3);
+		cg::vertex interpolate(const VB* vertices, float edge1, float edge2, float edge3);
 		bool depth_test(float z, size_t x, size_t y);
+		// Calls `visit_pixel(x, y, z, edge1, edge2, edge3)` row by row for every pixel that the front face of
+		// a triangle covers between the near and far planes, before any depth test. The vertices are after
+		// the vertex shader and the perspective division
+		template<typename F>
+		void rasterize_coverage(const VB* vertices, F&& visit_pixel);
+		// Rasterizes a triangle after the vertex shader and the perspective division
+		void rasterize_triangle(const VB* vertices, void* data, uint32_t draw_id, uint32_t triangle_id);
+		// The depth of `rasterize_triangle` alone, the same at every pixel
+		void rasterize_depth(const VB* vertices);
+		template<bool is_depth_only>
+		// Draws the triangles of the clusters once per instance, numbered from `vertex_offset`. Each cluster is
+		// culled by its sphere and cone only if `is_cluster_culled`, the instances always by their bounds
+		cluster_statistics draw_cluster_instances(const std::vector<cg::cluster>& clusters, size_t vertex_offset, bool is_cluster_culled, void* data);
+		bool is_outside_view(float3 bounds_min, float3 bounds_max, const float4x4& instance_transform);
+		// Whether every point of the cluster sees the back of every face of it from `position`, both in
+		// the object space of the cluster
+		static bool is_back_facing(const cg::cluster& cluster, float3 position);
+		// The pixels that the bounds may cover and their nearest depth, or false if they cross the camera plane
+		bool project_bounds(float3 bounds_min, float3 bounds_max, const float4x4& instance_transform, int2& pixels_begin, int2& pixels_end, float& min_z);
+		bool is_occluded(float3 bounds_min, float3 bounds_max, const float4x4& instance_transform);
+		void rasterize_occluder(const float4 (&positions)[3]);
+		void rasterize_visibility(const float4 (&positions)[3], uint32_t draw_id, uint32_t triangle_id);
 	};
 
 	template<typename VB, typename RT>
@@ -64,14 +207,29 @@ namespace cg::renderer
 	{
 		width = in_width;
 		height = in_height;
+		scissor = uint4{ 0, 0, static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_scissor(uint4 in_scissor)
+	{
+		scissor = in_scissor;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_view_position(float3 in_view_position)
+	{
+		view_position = in_view_position;
 	}
 
 	template<typename VB, typename RT>
 	inline void rasterizer<VB, RT>::clear_render_target(
 			const RT& in_clear_value, const float in_depth)
 	{
-		for (size_t i = 0; i < render_target->get_number_of_elements(); i++) {
-			render_target->item(i) = in_clear_value;
+		if (render_target) {
+			for (size_t i = 0; i < render_target->get_number_of_elements(); i++) {
+				render_target->item(i) = in_clear_value;
+			}
 		}
 
 		if (depth_buffer) {
@@ -79,6 +237,35 @@ namespace cg::renderer
 				depth_buffer->item(i) = in_depth;
 			}
 		}
+
+		if (visibility_buffer) {
+			for (size_t i = 0; i < visibility_buffer->get_number_of_elements(); i++) {
+				visibility_buffer->item(i) = visibility{};
+			}
+		}
+		for (auto& extra : extra_render_targets) {
+			for (size_t i = 0; i < extra.render_target->get_number_of_elements(); i++) {
+				extra.render_target->item(i) = extra.clear_value;
+			}
+		}
+		deferred_draws.clear();
+		draw_count = 0;
+		occlusion_pyramid.clear();
+		is_occlusion_pyramid_built = false;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::add_render_target(
+			std::shared_ptr<resource<cg::fcolor>> in_render_target,
+			std::function<cg::fcolor(const VB& vertex_data, void* data, const visibility& seen)> in_pixel_shader,
+			cg::fcolor in_clear_value)
+	{
+		extra_render_targets.push_back({ in_render_target, in_pixel_shader, in_clear_value });
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_visibility_buffer(std::shared_ptr<resource<visibility>> in_visibility_buffer) {
+		visibility_buffer = in_visibility_buffer;
 	}
 
 	template<typename VB, typename RT>
@@ -91,83 +278,577 @@ namespace cg::renderer
 		index_buffer = in_index_buffer;
 	}
 
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_instance_buffer(std::shared_ptr<resource<float4x4>> in_instance_buffer) {
+		instance_buffer = in_instance_buffer;
+	}
+
 	template<typename VB, typename RT>
 	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset, void* data) {
-		size_t vertex_id = vertex_offset;
-		std::vector<float2> vertices_2d(3);
+		uint32_t draw_id = draw_count++;
+		if (visibility_buffer) deferred_draws.push_back({ vertex_buffer, index_buffer, vertex_offset, vertex_shader, data });
 
-		while (vertex_id < vertex_offset + num_vertexes) {
+		for (size_t vertex_id = vertex_offset; vertex_id < vertex_offset + num_vertexes; vertex_id += 3) {
 			// Assume we only work with triangles
-			std::vector<VB> vertices {
-				vertex_buffer->item(index_buffer->item(vertex_id++)),
-				vertex_buffer->item(index_buffer->item(vertex_id++)),
-				vertex_buffer->item(index_buffer->item(vertex_id++))
-			};
+			VB vertices[3];
 
 			// apply some coordinate transformations + vertex shader to the triangle
 			for (int i = 0; i < 3; i++) {
 				auto& vertex = vertices[i];
-				vertex = vertex_shader(vertex);
+				vertex = vertex_shader(vertex_buffer->item(index_buffer->item(vertex_id + i)));
 				vertex.pos.xyz() /= vertex.pos.w;
+			}
 
-				vertices_2d[i] = float2 {
-					(1 + vertex.pos.x) * width / 2,
-					(1 - vertex.pos.y) * height / 2
-				};
-			}
-
-			// calculate bounding box
-			int2 min_coord { 0, 0 };
-			int2 max_coord { static_cast<int>(width), static_cast<int>(height) };
-			int2 min_vertex { floor(min(vertices_2d[0], min(vertices_2d[1], vertices_2d[2]))) };
-			int2 max_vertex { ceil(max(vertices_2d[0], max(vertices_2d[1], vertices_2d[2]))) };
-			uint2 bounding_box_begin { clamp(min_vertex, min_coord, max_coord) };
-			uint2 bounding_box_end { clamp(max_vertex, min_coord, max_coord) };
-
-			// precalculated values
-			float triangle_area = edge_function(vertices_2d[0], vertices_2d[1], vertices_2d[2]);
-			if (triangle_area < 0) continue; // cull backwards facing triangles
-			cg::vertex pixel_vertex;
-			float4 avgPos = (vertices[0].pos + vertices[1].pos + vertices[2].pos) / 3;
-			float4 pos1 = vertices[0].pos - avgPos;
-			float4 pos2 = vertices[1].pos - avgPos;
-			float4 pos3 = vertices[2].pos - avgPos;
-
-			// Iterating over pixels in the bounding box
-			for (size_t x = bounding_box_begin.x; x < bounding_box_end.x; x++) {
-				for (size_t y = bounding_box_begin.y; y < bounding_box_end.y; y++) {
-					float2 point { static_cast<float>(x), static_cast<float>(y)};
-					// edge values determine, whether the pixel belongs to the triangle
+			rasterize_triangle(vertices, data, draw_id, static_cast<uint32_t>((vertex_id - vertex_offset) / 3));
+		}
+	}
+
+	// The whole draw is a single cluster, that only the tests of the instance bounds cull
+	template<typename VB, typename RT>
+	inline size_t rasterizer<VB, RT>::draw_instanced(size_t num_vertexes, size_t vertex_offset, void* data)
+	{
+		cg::cluster range {};
+		range.first_index = static_cast<unsigned int>(vertex_offset);
+		range.index_count = static_cast<unsigned int>(num_vertexes);
+		return draw_cluster_instances<false>({ range }, vertex_offset, false, data).drawn;
+	}
+
+	template<typename VB, typename RT>
+	inline cluster_statistics rasterizer<VB, RT>::draw_clusters(const std::vector<cg::cluster>& clusters, void* data)
+	{
+		return draw_cluster_instances<false>(clusters, 0, true, data);
+	}
+
+	template<typename VB, typename RT>
+	inline cluster_statistics rasterizer<VB, RT>::draw_clusters_depth(const std::vector<cg::cluster>& clusters)
+	{
+		return draw_cluster_instances<true>(clusters, 0, true, nullptr);
+	}
+
+	template<typename VB, typename RT>
+	template<bool is_depth_only>
+	inline cluster_statistics rasterizer<VB, RT>::draw_cluster_instances(const std::vector<cg::cluster>& clusters, size_t vertex_offset, bool is_cluster_culled, void* data)
+	{
+		cluster_statistics statistics;
+		unsigned int first_index = std::numeric_limits<unsigned int>::max();
+		unsigned int last_index = 0;
+		for (const cg::cluster& cluster : clusters) {
+			for (unsigned int i = cluster.first_index; i < cluster.first_index + cluster.index_count; i++) {
+				first_index = std::min(first_index, index_buffer->item(i));
+				last_index = std::max(last_index, index_buffer->item(i));
+			}
+		}
+		if (first_index > last_index) return statistics;
+
+		// The instance that every vertex is used by last, and the bounds of the used ones
+		std::vector<size_t> used_by(last_index - first_index + 1, std::numeric_limits<size_t>::max());
+		float3 bounds_min { std::numeric_limits<float>::max() };
+		float3 bounds_max { std::numeric_limits<float>::lowest() };
+		for (const cg::cluster& cluster : clusters) {
+			for (unsigned int i = cluster.first_index; i < cluster.first_index + cluster.index_count; i++) {
+				unsigned int index = index_buffer->item(i);
+				if (used_by[index - first_index] == 0) continue;
+				used_by[index - first_index] = 0;
+				bounds_min = min(bounds_min, vertex_buffer->item(index).pos.xyz());
+				bounds_max = max(bounds_max, vertex_buffer->item(index).pos.xyz());
+			}
+		}
+		std::fill(used_by.begin(), used_by.end(), std::numeric_limits<size_t>::max());
+
+		std::vector<VB> transformed(used_by.size());
+		std::vector<const cg::cluster*> visible_clusters;
+		for (size_t instance_id = 0; instance_id < instance_buffer->get_number_of_elements(); instance_id++) {
+			const float4x4& transform = instance_buffer->item(instance_id);
+			if (is_outside_view(bounds_min, bounds_max, transform)) {
+				statistics.outside_view += clusters.size();
+				continue;
+			}
+			if (is_occluded(bounds_min, bounds_max, transform)) {
+				statistics.occluded += clusters.size();
+				for (const cg::cluster& cluster : clusters) statistics.occluded_triangles += cluster.index_count / 3;
+				continue;
+			}
+			float3 instance_view_position = mul(inverse(transform), float4{ view_position, 1.f }).xyz();
+
+			visible_clusters.clear();
+			for (const cg::cluster& cluster : clusters) {
+				if (!is_cluster_culled) {
+					visible_clusters.push_back(&cluster);
+				} else if (is_back_facing(cluster, instance_view_position)) {
+					statistics.back_facing++;
+				} else if (is_outside_view(cluster.center - cluster.radius, cluster.center + cluster.radius, transform)) {
+					statistics.outside_view++;
+				} else if (is_occluded(cluster.center - cluster.radius, cluster.center + cluster.radius, transform)) {
+					statistics.occluded++;
+					statistics.occluded_triangles += cluster.index_count / 3;
+				} else {
+					visible_clusters.push_back(&cluster);
+				}
+			}
+			if (visible_clusters.empty()) continue;
+			statistics.drawn += visible_clusters.size();
+
+			for (const cg::cluster* cluster : visible_clusters) {
+				for (unsigned int i = cluster->first_index; i < cluster->first_index + cluster->index_count; i++) used_by[index_buffer->item(i) - first_index] = instance_id;
+			}
+			for (size_t i = 0; i < used_by.size(); i++) {
+				if (used_by[i] != instance_id) continue;
+				VB& vertex = transformed[i];
+				vertex = instance_vertex_shader(vertex_buffer->item(first_index + i), transform);
+				vertex.pos.xyz() /= vertex.pos.w;
+			}
+
+			uint32_t draw_id = draw_count++;
+			if (visibility_buffer && !is_depth_only) {
+				auto shader = [instance_shader = instance_vertex_shader, transform](VB vertex_data) { return instance_shader(vertex_data, transform); };
+				deferred_draws.push_back({ vertex_buffer, index_buffer, vertex_offset, shader, data });
+			}
+			for (const cg::cluster* cluster : visible_clusters) {
+				for (size_t vertex_id = cluster->first_index; vertex_id < cluster->first_index + cluster->index_count; vertex_id += 3) {
+					VB vertices[3] = {
+						transformed[index_buffer->item(vertex_id) - first_index],
+						transformed[index_buffer->item(vertex_id + 1) - first_index],
+						transformed[index_buffer->item(vertex_id + 2) - first_index]
+					};
+					if constexpr (is_depth_only) {
+						rasterize_depth(vertices);
+					} else {
+						rasterize_triangle(vertices, data, draw_id, static_cast<uint32_t>((vertex_id - vertex_offset) / 3));
+					}
+				}
+			}
+		}
+		return statistics;
+	}
+
+	template<typename VB, typename RT>
+	inline size_t rasterizer<VB, RT>::draw_occluders(const std::vector<cg::cluster>& clusters)
+	{
+		if (occlusion_pyramid.empty()) {
+			size_t texels_x = (width + occlusion_texel_size - 1) / occlusion_texel_size;
+			size_t texels_y = (height + occlusion_texel_size - 1) / occlusion_texel_size;
+			occlusion_pyramid.emplace_back(texels_x, texels_y);
+			for (size_t i = 0; i < occlusion_pyramid[0].get_number_of_elements(); i++) occlusion_pyramid[0].item(i) = DEFAULT_DEPTH;
+		}
+
+		size_t drawn = 0;
+		float min_pixels = occluder_view_fraction * width * height;
+		float triangle_pixels = occluder_texels_per_triangle * occlusion_texel_size * occlusion_texel_size;
+		for (size_t instance_id = 0; instance_id < instance_buffer->get_number_of_elements(); instance_id++) {
+			const float4x4& transform = instance_buffer->item(instance_id);
+			float3 instance_view_position = mul(inverse(transform), float4{ view_position, 1.f }).xyz();
+			for (const cg::cluster& cluster : clusters) {
+				int2 pixels_begin, pixels_end;
+				float min_z;
+				if (is_back_facing(cluster, instance_view_position)) continue;
+				if (!project_bounds(cluster.center - cluster.radius, cluster.center + cluster.radius, transform, pixels_begin, pixels_end, min_z)) continue;
+				int2 pixels = max(pixels_end - pixels_begin, int2{ 0 });
+				float cluster_pixels = static_cast<float>(pixels.x) * pixels.y;
+				if (cluster_pixels < min_pixels || cluster_pixels < triangle_pixels * (cluster.index_count / 3)) continue;
+				drawn++;
+
+				for (unsigned int vertex_id = cluster.first_index; vertex_id < cluster.first_index + cluster.index_count; vertex_id += 3) {
+					float4 positions[3];
+					for (int v = 0; v < 3; v++) positions[v] = instance_vertex_shader(vertex_buffer->item(index_buffer->item(vertex_id + v)), transform).pos;
+					rasterize_occluder(positions);
+				}
+			}
+		}
+		return drawn;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::build_occlusion_pyramid()
+	{
+		if (occlusion_pyramid.empty()) return;
+		while (occlusion_pyramid.size() > 1) occlusion_pyramid.pop_back();
+		while (occlusion_pyramid.back().get_stride() > 1 || occlusion_pyramid.back().get_number_of_elements() > 1) {
+			cg::resource<float>& level = occlusion_pyramid.back();
+			size_t level_x = level.get_stride();
+			size_t level_y = level.get_number_of_elements() / level_x;
+			cg::resource<float> next((level_x + 1) / 2, (level_y + 1) / 2);
+			for (size_t y = 0; y < (level_y + 1) / 2; y++) {
+				for (size_t x = 0; x < (level_x + 1) / 2; x++) {
+					float depth = level.item(2 * x, 2 * y);
+					if (2 * x + 1 < level_x) depth = std::max(depth, level.item(2 * x + 1, 2 * y));
+					if (2 * y + 1 < level_y) depth = std::max(depth, level.item(2 * x, 2 * y + 1));
+					if (2 * x + 1 < level_x && 2 * y + 1 < level_y) depth = std::max(depth, level.item(2 * x + 1, 2 * y + 1));
+					next.item(x, y) = depth;
+				}
+			}
+			occlusion_pyramid.push_back(std::move(next));
+		}
+		is_occlusion_pyramid_built = true;
+	}
+
+	// The corners of the bounds that are in front of the camera project to a convex region that holds the
+	// projections of everything inside, and their depths take the extremes of the depths inside
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::project_bounds(float3 bounds_min, float3 bounds_max, const float4x4& instance_transform, int2& pixels_begin, int2& pixels_end, float& min_z)
+	{
+		float2 screen_min { std::numeric_limits<float>::max() };
+		float2 screen_max { std::numeric_limits<float>::lowest() };
+		min_z = std::numeric_limits<float>::max();
+		for (int corner = 0; corner < 8; corner++) {
+			VB vertex {};
+			vertex.pos = float4 {
+				corner & 1 ? bounds_max.x : bounds_min.x,
+				corner & 2 ? bounds_max.y : bounds_min.y,
+				corner & 4 ? bounds_max.z : bounds_min.z,
+				1.f
+			};
+			float4 position = instance_vertex_shader(vertex, instance_transform).pos;
+			if (position.w <= 0) return false;
+			float2 screen { (1 + position.x / position.w) * width / 2, (1 - position.y / position.w) * height / 2 };
+			screen_min = min(screen_min, screen);
+			screen_max = max(screen_max, screen);
+			min_z = std::min(min_z, position.z / position.w);
+		}
+		// the pixels that `rasterize_triangle` would visit for any triangle inside
+		pixels_begin = clamp(int2{ floor(screen_min) }, int2{ 0 }, int2{ static_cast<int>(width), static_cast<int>(height) });
+		pixels_end = clamp(int2{ ceil(screen_max) }, int2{ 0 }, int2{ static_cast<int>(width), static_cast<int>(height) });
+		return true;
+	}
+
+	// Whether the nearest depth of the bounds is behind the farthest occluder depth over all the pixels that
+	// they may cover, taken from the level of the pyramid where those are at most 2x2 texels
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::is_occluded(float3 bounds_min, float3 bounds_max, const float4x4& instance_transform)
+	{
+		if (!is_occlusion_pyramid_built) return false;
+		int2 pixels_begin, pixels_end;
+		float min_z;
+		if (!project_bounds(bounds_min, bounds_max, instance_transform, pixels_begin, pixels_end, min_z)) return false;
+		if (pixels_begin.x >= pixels_end.x || pixels_begin.y >= pixels_end.y) return false;
+
+		int2 texels_begin = pixels_begin / static_cast<int>(occlusion_texel_size);
+		int2 texels_end = (pixels_end - 1) / static_cast<int>(occlusion_texel_size);
+		size_t level = 0;
+		while (texels_end.x - texels_begin.x > 1 || texels_end.y - texels_begin.y > 1) {
+			texels_begin /= 2;
+			texels_end /= 2;
+			level++;
+		}
+		for (int y = texels_begin.y; y <= texels_end.y; y++) {
+			for (int x = texels_begin.x; x <= texels_end.x; x++) {
+				if (!(occlusion_pyramid[level].item(x, y) < min_z)) return false;
+			}
+		}
+		return true;
+	}
+
+	// The occluder depth of a texel is the farthest depth of the triangle at its corner pixels, where it
+	// is largest as the depth is affine over the screen, and a bit more to stay behind the depth that
+	// `rasterize_triangle` interpolates. The corners have to be inside of the triangle by a margin for
+	// every pixel between them to surely be too
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::rasterize_occluder(const float4 (&positions)[3])
+	{
+		constexpr float edge_margin = 1e-4f;
+		constexpr float depth_margin = 1e-6f;
+
+		float2 vertices_2d[3];
+		float z[3];
+		for (int i = 0; i < 3; i++) {
+			if (positions[i].w <= 0) return;
+			z[i] = positions[i].z / positions[i].w;
+			if (z[i] < 0 || z[i] > 1) return;
+			vertices_2d[i] = float2 {
+				(1 + positions[i].x / positions[i].w) * width / 2,
+				(1 - positions[i].y / positions[i].w) * height / 2
+			};
+		}
+		float triangle_area = edge_function(vertices_2d[0], vertices_2d[1], vertices_2d[2]);
+		if (triangle_area <= 0) return;
+
+		cg::resource<float>& occluder_depth = occlusion_pyramid[0];
+		int2 texels_end { static_cast<int>(occluder_depth.get_stride()), static_cast<int>(occluder_depth.get_number_of_elements() / occluder_depth.get_stride()) };
+		int2 min_vertex { floor(min(vertices_2d[0], min(vertices_2d[1], vertices_2d[2]))) };
+		int2 max_vertex { ceil(max(vertices_2d[0], max(vertices_2d[1], vertices_2d[2]))) };
+		int2 begin = clamp(min_vertex / static_cast<int>(occlusion_texel_size), int2{ 0 }, texels_end);
+		int2 end = clamp(max_vertex / static_cast<int>(occlusion_texel_size) + 1, int2{ 0 }, texels_end);
+		for (int y = begin.y; y < end.y; y++) {
+			for (int x = begin.x; x < end.x; x++) {
+				float corners_x[2] = { static_cast<float>(x * occlusion_texel_size), static_cast<float>(std::min((x + 1) * occlusion_texel_size, width) - 1) };
+				float corners_y[2] = { static_cast<float>(y * occlusion_texel_size), static_cast<float>(std::min((y + 1) * occlusion_texel_size, height) - 1) };
+				float depth = 0.f;
+				bool is_covered = true;
+				for (int corner = 0; corner < 4 && is_covered; corner++) {
+					float2 point { corners_x[corner & 1], corners_y[corner >> 1] };
 					float edge1 = edge_function(vertices_2d[0], vertices_2d[1], point) / triangle_area;
 					float edge2 = edge_function(vertices_2d[1], vertices_2d[2], point) / triangle_area;
 					float edge3 = edge_function(vertices_2d[2], vertices_2d[0], point) / triangle_area;
+					is_covered = edge1 > edge_margin && edge2 > edge_margin && edge3 > edge_margin;
+					depth = std::max(depth, edge2 * z[0] + edge3 * z[1] + edge1 * z[2]);
+				}
+				if (is_covered) occluder_depth.item(x, y) = std::min(occluder_depth.item(x, y), depth + depth_margin);
+			}
+		}
+	}
+
+	// With the cone of the face normals around the axis at an angle whose sine is s, every face of the
+	// cluster is seen from the back if the direction from the position to the sphere is s away from the
+	// cone, and the sphere is far enough for no point of it to see the cone from a wider angle
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::is_back_facing(const cg::cluster& cluster, float3 position)
+	{
+		if (cluster.cone_sine >= 1) return false;
+		float3 direction = cluster.center - position;
+		return dot(direction, cluster.cone_axis) >= length(direction) * cluster.cone_sine + cluster.radius * (1 + cluster.cone_sine);
+	}
+
+	// Whether all the corners of the bounds are outside of the same plane of the clip space
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::is_outside_view(float3 bounds_min, float3 bounds_max, const float4x4& instance_transform)
+	{
+		int outside[6] = {};
+		for (int corner = 0; corner < 8; corner++) {
+			VB vertex {};
+			vertex.pos = float4 {
+				corner & 1 ? bounds_max.x : bounds_min.x,
+				corner & 2 ? bounds_max.y : bounds_min.y,
+				corner & 4 ? bounds_max.z : bounds_min.z,
+				1.f
+			};
+			float4 position = instance_vertex_shader(vertex, instance_transform).pos;
+			outside[0] += position.x < -position.w;
+			outside[1] += position.x > position.w;
+			outside[2] += position.y < -position.w;
+			outside[3] += position.y > position.w;
+			outside[4] += position.z < 0;
+			outside[5] += position.z > position.w;
+		}
+		return std::find(outside, outside + 6, 8) != outside + 6;
+	}
+
+	template<typename VB, typename RT>
+	template<typename F>
+	inline void rasterizer<VB, RT>::rasterize_coverage(const VB* vertices, F&& visit_pixel)
+	{
+		float2 vertices_2d[3];
+		for (int i = 0; i < 3; i++) {
+			vertices_2d[i] = float2 {
+				(1 + vertices[i].pos.x) * width / 2,
+				(1 - vertices[i].pos.y) * height / 2
+			};
+		}
+
+		// calculate bounding box
+		int2 min_coord { 0, 0 };
+		int2 max_coord { static_cast<int>(width), static_cast<int>(height) };
+		int2 min_vertex { floor(min(vertices_2d[0], min(vertices_2d[1], vertices_2d[2]))) };
+		int2 max_vertex { ceil(max(vertices_2d[0], max(vertices_2d[1], vertices_2d[2]))) };
+		uint2 bounding_box_begin { clamp(min_vertex, min_coord, max_coord) };
+		uint2 bounding_box_end { clamp(max_vertex, min_coord, max_coord) };
+
+		// precalculated values
+		float triangle_area = edge_function(vertices_2d[0], vertices_2d[1], vertices_2d[2]);
+		if (triangle_area < 0) return; // cull backwards facing triangles
+
+		// Iterating over pixels in the bounding box, row by row as the buffers are laid out
+		for (size_t y = bounding_box_begin.y; y < bounding_box_end.y; y++) {
+			for (size_t x = bounding_box_begin.x; x < bounding_box_end.x; x++) {
+				float2 point { static_cast<float>(x), static_cast<float>(y)};
+				// edge values determine, whether the pixel belongs to the triangle
+				float edge1 = edge_function(vertices_2d[0], vertices_2d[1], point) / triangle_area;
+				float edge2 = edge_function(vertices_2d[1], vertices_2d[2], point) / triangle_area;
+				float edge3 = edge_function(vertices_2d[2], vertices_2d[0], point) / triangle_area;
+
+				if (edge1 < 0 || edge2 < 0 || edge3 < 0 ) continue;
+				if (edge1 > 1 || edge2 > 1 || edge3 > 1 ) continue;
+
+				// interpolate pixel coordinates
+				float z = interpolate_position(vertices, edge1, edge2, edge3).z;
+				if (z < 0 || z > 1) continue; // near/far camera clipping
+				visit_pixel(x, y, z, edge1, edge2, edge3);
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::rasterize_triangle(const VB* vertices, void* data, uint32_t draw_id, uint32_t triangle_id)
+	{
+		rasterize_coverage(vertices, [&](size_t x, size_t y, float z, float edge1, float edge2, float edge3) {
+			if (!depth_test(z, x, y)) return;
+
+			if (depth_buffer) depth_buffer->item(x, y) = z;
+			if (visibility_buffer) {
+				visibility_buffer->item(x, y) = visibility{ draw_id, triangle_id };
+				return;
+			}
 
-					if (edge1 < 0 || edge2 < 0 || edge3 < 0 ) continue;
-					if (edge1 > 1 || edge2 > 1 || edge3 > 1 ) continue;
-
-					// interpolate pixel coordinates
-					pixel_vertex.pos = (edge2 * pos1 + edge3 * pos2 + edge1 * pos3) + avgPos;
-					float z = pixel_vertex.pos.z;
-					if (z < 0 || z > 1) continue; // near/far camera clipping
-					if (!depth_test(z, x, y)) continue;
-
-					// This is perspective correct texture mapping (from wikipedia)
-					float uv_edge1 = edge1 / (vertices[2].pos.z * vertices[2].pos.w);
-					float uv_edge2 = edge2 / (vertices[0].pos.z * vertices[0].pos.w);
-					float uv_edge3 = edge3 / (vertices[1].pos.z * vertices[1].pos.w);
-					float2 uv_raw = uv_edge2 * vertices[0].uv + uv_edge3 * vertices[1].uv + uv_edge1 * vertices[2].uv;
-					
-					pixel_vertex.uv = uv_raw / (uv_edge1 + uv_edge2 + uv_edge3);
-					pixel_vertex.ambient = edge2 * vertices[0].ambient + edge3 * vertices[1].ambient + edge1 * vertices[2].ambient;
-					
-					cg::fcolor pixel_result = pixel_shader(pixel_vertex, data);
-					render_target->item(x, y) = cg::from_fcolor(pixel_result);
-					if (depth_buffer) depth_buffer->item(x, y) = z;
+			cg::vertex pixel_vertex = interpolate(vertices, edge1, edge2, edge3);
+			cg::fcolor pixel_result = pixel_shader(pixel_vertex, data);
+			render_target->item(x, y) = cg::from_fcolor(pixel_result);
+			for (auto& extra : extra_render_targets) {
+				extra.render_target->item(x, y) = extra.pixel_shader(pixel_vertex, data, visibility{ draw_id, triangle_id });
+			}
+		});
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::rasterize_depth(const VB* vertices)
+	{
+		if (!depth_buffer) return;
+		rasterize_coverage(vertices, [&](size_t x, size_t y, float z, float, float, float) {
+			float& depth = depth_buffer->item(x, y);
+			if (depth > z) depth = z;
+		});
+	}
+
+	// The triangle of a pixel is set up again as `draw` did it, so that its edge values and attributes
+	// come out the same. Runs of pixels along a row mostly see the same triangle, and share the setup
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::resolve()
+	{
+		#pragma omp parallel for schedule(dynamic)
+		for (int y = 0; y < static_cast<int>(height); y++) {
+			visibility last;
+			VB vertices[3];
+			float2 vertices_2d[3];
+			float triangle_area = 0.f;
+			for (size_t x = 0; x < width; x++) {
+				const visibility& seen = visibility_buffer->item(x, y);
+				if (seen.draw_id == visibility::none) continue;
+
+				const deferred_draw& draw = deferred_draws[seen.draw_id];
+				if (seen.draw_id != last.draw_id || seen.triangle_id != last.triangle_id) {
+					size_t vertex_id = draw.vertex_offset + static_cast<size_t>(seen.triangle_id) * 3;
+					for (int i = 0; i < 3; i++) {
+						VB& vertex = vertices[i];
+						vertex = draw.vertex_shader(draw.vertex_buffer->item(draw.index_buffer->item(vertex_id + i)));
+						vertex.pos.xyz() /= vertex.pos.w;
+						vertices_2d[i] = float2 {
+							(1 + vertex.pos.x) * width / 2,
+							(1 - vertex.pos.y) * height / 2
+						};
+					}
+					triangle_area = edge_function(vertices_2d[0], vertices_2d[1], vertices_2d[2]);
+					last = seen;
+				}
+
+				float2 point { static_cast<float>(x), static_cast<float>(y) };
+				float edge1 = edge_function(vertices_2d[0], vertices_2d[1], point) / triangle_area;
+				float edge2 = edge_function(vertices_2d[1], vertices_2d[2], point) / triangle_area;
+				float edge3 = edge_function(vertices_2d[2], vertices_2d[0], point) / triangle_area;
+
+				cg::vertex pixel_vertex = interpolate(vertices, edge1, edge2, edge3);
+				cg::fcolor pixel_result = pixel_shader(pixel_vertex, draw.data);
+				render_target->item(x, y) = cg::from_fcolor(pixel_result);
+				for (auto& extra : extra_render_targets) {
+					extra.render_target->item(x, y) = extra.pixel_shader(pixel_vertex, draw.data, seen);
 				}
 			}
 		}
 	}
+
+	template<typename VB, typename RT>
+	inline float4 rasterizer<VB, RT>::interpolate_position(const VB* vertices, float edge1, float edge2, float edge3)
+	{
+		float4 avgPos = (vertices[0].pos + vertices[1].pos + vertices[2].pos) / 3;
+		float4 pos1 = vertices[0].pos - avgPos;
+		float4 pos2 = vertices[1].pos - avgPos;
+		float4 pos3 = vertices[2].pos - avgPos;
+		return (edge2 * pos1 + edge3 * pos2 + edge1 * pos3) + avgPos;
+	}
+
+	template<typename VB, typename RT>
+	inline cg::vertex rasterizer<VB, RT>::interpolate(const VB* vertices, float edge1, float edge2, float edge3)
+	{
+		cg::vertex pixel_vertex;
+		pixel_vertex.pos = interpolate_position(vertices, edge1, edge2, edge3);
+
+		// This is perspective correct texture mapping (from wikipedia)
+		float uv_edge1 = edge1 / (vertices[2].pos.z * vertices[2].pos.w);
+		float uv_edge2 = edge2 / (vertices[0].pos.z * vertices[0].pos.w);
+		float uv_edge3 = edge3 / (vertices[1].pos.z * vertices[1].pos.w);
+		float2 uv_raw = uv_edge2 * vertices[0].uv + uv_edge3 * vertices[1].uv + uv_edge1 * vertices[2].uv;
+
+		pixel_vertex.uv = uv_raw / (uv_edge1 + uv_edge2 + uv_edge3);
+		pixel_vertex.norm = edge2 * vertices[0].norm + edge3 * vertices[1].norm + edge1 * vertices[2].norm;
+		pixel_vertex.ambient = edge2 * vertices[0].ambient + edge3 * vertices[1].ambient + edge1 * vertices[2].ambient;
+		return pixel_vertex;
+	}
 	
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::draw_visibility(size_t num_vertexes, size_t vertex_offset, uint32_t draw_id)
+	{
+		for (size_t vertex_id = vertex_offset; vertex_id + 3 <= vertex_offset + num_vertexes; vertex_id += 3) {
+			float4 positions[3];
+			int inside_count = 0;
+			for (int i = 0; i < 3; i++) {
+				positions[i] = vertex_shader(vertex_buffer->item(index_buffer->item(vertex_id + i))).pos;
+				inside_count += positions[i].w - positions[i].z >= 0;
+			}
+			if (inside_count == 0) continue;
+
+			uint32_t triangle_id = static_cast<uint32_t>((vertex_id - vertex_offset) / 3);
+			if (inside_count == 3) {
+				rasterize_visibility(positions, draw_id, triangle_id);
+				continue;
+			}
+
+			// Clips the polygon by the near plane z = w of the clip space, where w is still positive,
+			// and splits the quad that may be left into two triangles
+			float4 clipped[4];
+			int clipped_count = 0;
+			for (int i = 0; i < 3; i++) {
+				const float4& from = positions[i];
+				const float4& to = positions[(i + 1) % 3];
+				float from_distance = from.w - from.z;
+				float to_distance = to.w - to.z;
+				if (from_distance >= 0) clipped[clipped_count++] = from;
+				if ((from_distance >= 0) != (to_distance >= 0)) clipped[clipped_count++] = from + (to - from) * (from_distance / (from_distance - to_distance));
+			}
+			for (int i = 1; i + 1 < clipped_count; i++) {
+				float4 fan[3] = { clipped[0], clipped[i], clipped[i + 1] };
+				rasterize_visibility(fan, draw_id, triangle_id);
+			}
+		}
+	}
+
+	// The coverage of `draw` within the scissor, with the facing of the triangle ignored and the depth reversed
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::rasterize_visibility(const float4 (&positions)[3], uint32_t draw_id, uint32_t triangle_id)
+	{
+		float2 vertices_2d[3];
+		float z[3];
+		for (int i = 0; i < 3; i++) {
+			float3 ndc = positions[i].xyz() / positions[i].w;
+			vertices_2d[i] = float2{ (1 + ndc.x) * width / 2, (1 - ndc.y) * height / 2 };
+			z[i] = ndc.z;
+		}
+
+		float triangle_area = edge_function(vertices_2d[0], vertices_2d[1], vertices_2d[2]);
+		if (triangle_area == 0) return;
+
+		int2 min_coord { static_cast<int>(scissor.x), static_cast<int>(scissor.y) };
+		int2 max_coord { static_cast<int>(scissor.x + scissor.z), static_cast<int>(scissor.y + scissor.w) };
+		int2 min_vertex { floor(min(vertices_2d[0], min(vertices_2d[1], vertices_2d[2]))) };
+		int2 max_vertex { ceil(max(vertices_2d[0], max(vertices_2d[1], vertices_2d[2]))) };
+		uint2 bounding_box_begin { clamp(min_vertex, min_coord, max_coord) };
+		uint2 bounding_box_end { clamp(max_vertex, min_coord, max_coord) };
+
+		for (size_t y = bounding_box_begin.y; y < bounding_box_end.y; y++) {
+			for (size_t x = bounding_box_begin.x; x < bounding_box_end.x; x++) {
+				float2 point { static_cast<float>(x), static_cast<float>(y) };
+				float edge1 = edge_function(vertices_2d[0], vertices_2d[1], point) / triangle_area;
+				float edge2 = edge_function(vertices_2d[1], vertices_2d[2], point) / triangle_area;
+				float edge3 = edge_function(vertices_2d[2], vertices_2d[0], point) / triangle_area;
+
+				if (edge1 < 0 || edge2 < 0 || edge3 < 0 ) continue;
+				if (edge1 > 1 || edge2 > 1 || edge3 > 1 ) continue;
+
+				float pixel_z = edge2 * z[0] + edge3 * z[1] + edge1 * z[2];
+				if (pixel_z < 0 || pixel_z > 1) continue;
+				if (depth_buffer && depth_buffer->item(x, y) >= pixel_z) continue;
+
+				if (depth_buffer) depth_buffer->item(x, y) = pixel_z;
+				if (visibility_buffer) visibility_buffer->item(x, y) = visibility{ draw_id, triangle_id };
+			}
+		}
+	}
+
 	template<typename VB, typename RT>
 	inline float
 	rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c) {
@@ -1,18 +1,26 @@
 #include "rasterizer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
+
+#include <limits>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 void cg::renderer::rasterization_renderer::init() {
 	rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::ucolor>>();
 	rasterizer->set_viewport(settings->width, settings->height);
-	render_target = std::make_shared<cg::resource<cg::ucolor>>(settings->width, settings->height);
+	if (!settings->depth_only)
+		render_target = std::make_shared<cg::resource<cg::ucolor>>(settings->width, settings->height);
 
 	if (!settings->disable_depth)
 		depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
 	
 	rasterizer->set_render_target(render_target, depth_buffer);
+	if (settings->visibility_buffer) {
+		visibility_buffer = std::make_shared<cg::resource<cg::renderer::visibility>>(settings->width, settings->height);
+		rasterizer->set_visibility_buffer(visibility_buffer);
+	}
 
 	model = std::make_shared<cg::world::model>(settings->model_path);
 
@@ -25,6 +33,85 @@ void cg::renderer::rasterization_renderer::init() {
 	camera->set_field_of_view(settings->camera_angle_of_view);
 	camera->set_z_near(settings->camera_z_near);
 	camera->set_z_far(settings->camera_z_far);
+
+	fill_instance_buffer();
+	add_extra_targets();
+	if (settings->depth_only) init_depth_only();
+}
+
+void cg::renderer::rasterization_renderer::init_depth_only() {
+	depth_rasterizer = std::make_shared<cg::renderer::rasterizer<depth_vertex, cg::ucolor>>();
+	depth_rasterizer->set_viewport(settings->width, settings->height);
+	depth_rasterizer->set_render_target(nullptr, depth_buffer);
+	depth_rasterizer->set_instance_buffer(instance_buffer);
+
+	for (auto& vertex_buffer : model->get_vertex_buffers()) {
+		auto positions = std::make_shared<cg::resource<depth_vertex>>(vertex_buffer->get_number_of_elements());
+		for (size_t i = 0; i < vertex_buffer->get_number_of_elements(); i++) positions->item(i).pos = vertex_buffer->item(i).pos;
+		depth_vertex_buffers.push_back(positions);
+	}
+}
+
+void cg::renderer::rasterization_renderer::add_extra_targets() {
+	if (!settings->linear_depth_result_path.empty()) {
+		linear_depth_target = std::make_shared<cg::resource<cg::fcolor>>(settings->width, settings->height);
+		// the inverse of the depth mapping of the projection matrix
+		float z_near = settings->camera_z_near;
+		float z_far = settings->camera_z_far;
+		// nothing drawn is infinitely far
+		rasterizer->add_render_target(linear_depth_target, [z_near, z_far](const cg::vertex& vertex, void*, const cg::renderer::visibility&) {
+			float distance = (z_far * z_near / (z_near - z_far)) / (vertex.pos.z + z_far / (z_near - z_far));
+			return cg::fcolor{ distance };
+		}, cg::fcolor{ std::numeric_limits<float>::infinity() });
+	}
+	if (!settings->normal_result_path.empty()) {
+		normal_target = std::make_shared<cg::resource<cg::fcolor>>(settings->width, settings->height);
+		rasterizer->add_render_target(normal_target, [](const cg::vertex& vertex, void*, const cg::renderer::visibility&) {
+			return length(vertex.norm) > 0 ? normalize(vertex.norm) : vertex.norm;
+		});
+	}
+	if (!settings->uv_result_path.empty()) {
+		uv_target = std::make_shared<cg::resource<cg::fcolor>>(settings->width, settings->height);
+		rasterizer->add_render_target(uv_target, [](const cg::vertex& vertex, void*, const cg::renderer::visibility&) {
+			return cg::fcolor{ vertex.uv.x, vertex.uv.y, 0.f };
+		});
+	}
+	if (!settings->id_result_path.empty()) {
+		// floats hold the ids exactly up to 2^24, and nothing drawn is -1
+		constexpr size_t max_id = size_t{ 1 } << 24;
+		size_t draw_count = model->get_index_buffers().size() * settings->instance_grid * settings->instance_grid;
+		for (auto& index_buffer : model->get_index_buffers()) {
+			if (index_buffer->get_number_of_elements() / 3 > max_id) THROW_ERROR("Triangle ids of meshes over 2^24 triangles can't be exported");
+		}
+		if (draw_count > max_id) THROW_ERROR("Draw ids over 2^24 can't be exported");
+		id_target = std::make_shared<cg::resource<cg::fcolor>>(settings->width, settings->height);
+		rasterizer->add_render_target(id_target, [](const cg::vertex&, void*, const cg::renderer::visibility& seen) {
+			return cg::fcolor{ static_cast<float>(seen.draw_id), static_cast<float>(seen.triangle_id), 0.f };
+		}, cg::fcolor{ -1.f, -1.f, 0.f });
+	}
+}
+
+// The model at its world matrix, and its copies on a grid next to it spaced as the raytracer spaces them
+void cg::renderer::rasterization_renderer::fill_instance_buffer() {
+	float3 bounds_min { std::numeric_limits<float>::max() };
+	float3 bounds_max { std::numeric_limits<float>::lowest() };
+	for (auto& vertex_buffer : model->get_vertex_buffers()) {
+		for (size_t i = 0; i < vertex_buffer->get_number_of_elements(); i++) {
+			bounds_min = min(bounds_min, vertex_buffer->item(i).pos.xyz());
+			bounds_max = max(bounds_max, vertex_buffer->item(i).pos.xyz());
+		}
+	}
+	float3 spacing = max(bounds_max - bounds_min, float3{ 0.f }) * 1.25f;
+
+	unsigned grid = settings->instance_grid;
+	instance_buffer = std::make_shared<cg::resource<float4x4>>(grid * grid);
+	for (unsigned z = 0; z < grid; z++) {
+		for (unsigned x = 0; x < grid; x++) {
+			float3 offset { spacing.x * x, 0.f, -spacing.z * z };
+			instance_buffer->item(x + z * grid) = mul(linalg::translation_matrix(offset), model->get_world_matrix());
+		}
+	}
+	rasterizer->set_instance_buffer(instance_buffer);
 }
 
 typedef std::function<cg::fcolor (const cg::vertex&, void*)> PixelShader;
@@ -71,15 +158,27 @@ sampler2D get_texture_sampler_nn(const unsigned char* texture, int w, int h, int
 	};
 }
 
+void print_cluster_statistics(const cg::renderer::cluster_statistics& clusters, size_t occluders, bool is_occlusion_culled) {
+	std::cout << "Clusters: " << clusters.drawn << " of " << clusters.drawn + clusters.outside_view + clusters.back_facing + clusters.occluded
+			  << " cluster instances drawn, " << clusters.outside_view << " outside of the view, "
+			  << clusters.back_facing << " facing away, " << clusters.occluded << " occluded\n";
+	if (is_occlusion_culled)
+		std::cout << "Occlusion: " << occluders << " occluder cluster instances hid " << clusters.occluded
+				  << " cluster instances, skipping " << clusters.occluded_triangles << " triangles\n";
+}
+
 void cg::renderer::rasterization_renderer::render()
 {
-	float4x4 matrix = mul(
-		camera->get_projection_matrix(), 
-		camera->get_view_matrix(),
-		model->get_world_matrix()
-	);
-	rasterizer->vertex_shader = [&](cg::vertex vertex) {
-		vertex.pos = mul(matrix, vertex.pos);
+	if (settings->depth_only) {
+		render_depth_only();
+		return;
+	}
+
+	float4x4 view_projection = mul(camera->get_projection_matrix(), camera->get_view_matrix());
+	rasterizer->set_view_position(camera->get_position());
+	rasterizer->instance_vertex_shader = [&](cg::vertex vertex, const float4x4& instance_transform) {
+		vertex.pos = mul(mul(view_projection, instance_transform), vertex.pos);
+		vertex.norm = mul(instance_transform, float4{ vertex.norm, 0.f }).xyz();
 		return vertex;
 	};
 
@@ -92,14 +191,33 @@ void cg::renderer::rasterization_renderer::render()
 
 	rasterizer->pixel_shader = zshader ? depth_pixel_shader(bias, fade) : (fogshader ? fog_pixel_shader(bias, fade) : texture_pixel_shader);
 
+	std::vector<unsigned char*> texture_data(model->get_index_buffers().size(), nullptr);
+	std::vector<sampler2D> texture_samplers(texture_data.size());
+	cg::renderer::cluster_statistics clusters;
+
 	PRINT_EXECUTION_TIME("Clear time", 
 		rasterizer->clear_render_target({0, 0, 0});
 	);
 
+	auto& vertices = model->get_vertex_buffers();
+	auto& indices = model->get_index_buffers();
+	auto& textures = model->get_per_shape_texture_files();
+	auto& mesh_clusters = model->get_clusters();
+
+	// the occluders are only drawn in depth, and nothing can be skipped behind them without one
+	size_t occluders = 0;
+	if (settings->occlusion_culling && depth_buffer) {
+		PRINT_EXECUTION_TIME("Occluder time", 
+			for (size_t mesh_idx = 0; mesh_idx < indices.size(); mesh_idx++) {
+				rasterizer->set_vertex_buffer(vertices[mesh_idx]);
+				rasterizer->set_index_buffer(indices[mesh_idx]);
+				occluders += rasterizer->draw_occluders(mesh_clusters[mesh_idx]);
+			}
+			rasterizer->build_occlusion_pyramid();
+		);
+	}
+
 	PRINT_EXECUTION_TIME("Draw time", 
-		auto& vertices = model->get_vertex_buffers();
-		auto& indices = model->get_index_buffers();
-		auto& textures = model->get_per_shape_texture_files();
 
 		for (size_t mesh_idx = 0; mesh_idx < indices.size(); mesh_idx++) {
 			rasterizer->set_vertex_buffer(vertices[mesh_idx]);
@@ -108,21 +226,81 @@ void cg::renderer::rasterization_renderer::render()
 			int w;
 			int h;
 			int _;
-			unsigned char *data = stbi_load(path.string().c_str(), &w, &h, &_, 3);
+			texture_data[mesh_idx] = stbi_load(path.string().c_str(), &w, &h, &_, 3);
+			unsigned char *data = texture_data[mesh_idx];
 
-			sampler2D texSampler = get_texture_sampler_nn(data, w, h, 3);
-			rasterizer->draw(indices[mesh_idx]->get_number_of_elements(), 0, data ? &texSampler : nullptr);
-			if (data) stbi_image_free(data);
+			texture_samplers[mesh_idx] = get_texture_sampler_nn(data, w, h, 3);
+			clusters += rasterizer->draw_clusters(mesh_clusters[mesh_idx], data ? &texture_samplers[mesh_idx] : nullptr);
+			// the resolve pass samples the textures later
+			if (data && !visibility_buffer) stbi_image_free(data);
 		}
 	);
 
+	print_cluster_statistics(clusters, occluders, settings->occlusion_culling && depth_buffer);
+
+	if (visibility_buffer) {
+		PRINT_EXECUTION_TIME("Resolve time", 
+			rasterizer->resolve();
+		);
+		for (unsigned char* data : texture_data) {
+			if (data) stbi_image_free(data);
+		}
+	}
+
 	// save render target as an image at `settings->result_path`
 	cg::utils::save_resource(*render_target, settings->result_path);
 	if (!settings->depth_result_path.empty() && depth_buffer)
 		cg::utils::save_resource(*depth_buffer, settings->depth_result_path);
+	if (linear_depth_target) cg::utils::save_resource(*linear_depth_target, settings->linear_depth_result_path);
+	if (normal_target) cg::utils::save_resource(*normal_target, settings->normal_result_path);
+	if (uv_target) cg::utils::save_resource(*uv_target, settings->uv_result_path);
+	if (id_target) cg::utils::save_resource(*id_target, settings->id_result_path);
 	if (settings->show_render) cg::utils::open_file_with_system_app(settings->result_path);
 }
 
+// The same draws with positions alone, no textures, attributes or pixel shader, and only the depth saved
+void cg::renderer::rasterization_renderer::render_depth_only()
+{
+	float4x4 view_projection = mul(camera->get_projection_matrix(), camera->get_view_matrix());
+	depth_rasterizer->set_view_position(camera->get_position());
+	depth_rasterizer->instance_vertex_shader = [&](depth_vertex vertex, const float4x4& instance_transform) {
+		vertex.pos = mul(mul(view_projection, instance_transform), vertex.pos);
+		return vertex;
+	};
+
+	auto& indices = model->get_index_buffers();
+	auto& mesh_clusters = model->get_clusters();
+	cg::renderer::cluster_statistics clusters;
+
+	PRINT_EXECUTION_TIME("Clear time", 
+		depth_rasterizer->clear_render_target({0, 0, 0});
+	);
+
+	size_t occluders = 0;
+	if (settings->occlusion_culling) {
+		PRINT_EXECUTION_TIME("Occluder time", 
+			for (size_t mesh_idx = 0; mesh_idx < indices.size(); mesh_idx++) {
+				depth_rasterizer->set_vertex_buffer(depth_vertex_buffers[mesh_idx]);
+				depth_rasterizer->set_index_buffer(indices[mesh_idx]);
+				occluders += depth_rasterizer->draw_occluders(mesh_clusters[mesh_idx]);
+			}
+			depth_rasterizer->build_occlusion_pyramid();
+		);
+	}
+
+	PRINT_EXECUTION_TIME("Draw time", 
+		for (size_t mesh_idx = 0; mesh_idx < indices.size(); mesh_idx++) {
+			depth_rasterizer->set_vertex_buffer(depth_vertex_buffers[mesh_idx]);
+			depth_rasterizer->set_index_buffer(indices[mesh_idx]);
+			clusters += depth_rasterizer->draw_clusters_depth(mesh_clusters[mesh_idx]);
+		}
+	);
+
+	print_cluster_statistics(clusters, occluders, settings->occlusion_culling);
+
+	cg::utils::save_resource(*depth_buffer, settings->depth_result_path);
+}
+
 void cg::renderer::rasterization_renderer::destroy() {}
 
 void cg::renderer::rasterization_renderer::update() {}
\ No newline at end of file
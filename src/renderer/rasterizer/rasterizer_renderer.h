@@ -5,6 +5,12 @@
 
 namespace cg::renderer
 {
+	// All that depth only rendering keeps of a vertex
+	struct depth_vertex
+	{
+		float4 pos;
+	};
+
 	class rasterization_renderer : public renderer
 	{
 	public:
@@ -17,7 +23,23 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::resource<cg::ucolor>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<cg::renderer::visibility>> visibility_buffer;
+		// The extra outputs that are asked for, written in the same pass as the render target
+		std::shared_ptr<cg::resource<cg::fcolor>> linear_depth_target;
+		std::shared_ptr<cg::resource<cg::fcolor>> normal_target;
+		std::shared_ptr<cg::resource<cg::fcolor>> uv_target;
+		std::shared_ptr<cg::resource<cg::fcolor>> id_target;
+		// World transforms of the model and of its copies on the instance grid
+		std::shared_ptr<cg::resource<float4x4>> instance_buffer;
 
 		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::ucolor>> rasterizer;
+		// The positions of the model, and the rasterizer that draws them, for depth only rendering
+		std::vector<std::shared_ptr<cg::resource<depth_vertex>>> depth_vertex_buffers;
+		std::shared_ptr<cg::renderer::rasterizer<depth_vertex, cg::ucolor>> depth_rasterizer;
+
+		void fill_instance_buffer();
+		void add_extra_targets();
+		void init_depth_only();
+		void render_depth_only();
 	};
 } // namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <linalg.h>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Running mean of the linear radiance of one pixel, together with the variance of its
+	// luminance, updated with Welford's algorithm so that both stay stable over many samples
+	struct accumulator
+	{
+		float3 mean{ 0.f };
+		float luminance_m2 = 0.f;
+		uint32_t count = 0;
+
+		void add(float3 sample);
+		void merge(const accumulator& other);
+		float get_luminance() const;
+		float get_variance() const;
+		float get_error() const;
+	};
+
+	inline float get_luminance(float3 color) { return dot(color, float3{ 0.2126f, 0.7152f, 0.0722f }); }
+
+	inline void accumulator::add(float3 sample)
+	{
+		float old_luminance = get_luminance();
+		count++;
+		mean += (sample - mean) / static_cast<float>(count);
+		luminance_m2 += (cg::renderer::get_luminance(sample) - old_luminance) * (cg::renderer::get_luminance(sample) - get_luminance());
+	}
+
+	// Combines the statistics of two disjoint sets of samples (Chan et al.)
+	inline void accumulator::merge(const accumulator& other)
+	{
+		if (other.count == 0) return;
+		uint32_t total = count + other.count;
+		float other_share = static_cast<float>(other.count) / static_cast<float>(total);
+		float luminance_delta = other.get_luminance() - get_luminance();
+
+		luminance_m2 += other.luminance_m2 + luminance_delta * luminance_delta * static_cast<float>(count) * other_share;
+		mean += (other.mean - mean) * other_share;
+		count = total;
+	}
+
+	inline float accumulator::get_luminance() const { return cg::renderer::get_luminance(mean); }
+
+	// Sample variance of the luminance
+	inline float accumulator::get_variance() const { return count > 1 ? luminance_m2 / static_cast<float>(count - 1) : 0.f; }
+
+	// Half-width of the 95% confidence interval of the mean luminance, carried through the square root
+	// applied on resolve, i.e. the expected error of the displayed value. Dark pixels use a floor, as
+	// the slope of the square root grows without bound near zero
+	inline float accumulator::get_error() const
+	{
+		if (count < 2) return std::numeric_limits<float>::infinity();
+		constexpr float dark_floor = 1e-4f;
+		float half_width = 1.96f * std::sqrt(get_variance() / static_cast<float>(count));
+		return half_width / (2 * std::sqrt(std::max(get_luminance(), dark_floor)));
+	}
+} // namespace cg::renderer
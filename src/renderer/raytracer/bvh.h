@@ -0,0 +1,1114 @@
+#pragma once
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <linalg.h>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	class aabb
+	{
+	public:
+		aabb() = default;
+		aabb(float3 in_min, float3 in_max);
+
+		void add_point(float3 point);
+		void add_aabb(const aabb& other);
+		bool is_empty() const;
+		float get_area() const;
+		float3 get_center() const;
+		float3 get_min() const;
+		float3 get_max() const;
+		// Shrinks the box to its overlap with `other`, an empty box if they don't overlap
+		void clip(const aabb& other);
+		// Distance at which the ray enters the box within [min_t, max_t], or infinity if it misses it
+		float intersect(float3 position, float3 inv_direction, float max_t, float min_t) const;
+
+	protected:
+		float3 aabb_min{ std::numeric_limits<float>::max() };
+		float3 aabb_max{ -std::numeric_limits<float>::max() };
+	};
+
+	// An interior node has no primitives and its children at `first` and `first + 1`, a leaf covers
+	// the primitives [first, first + count). Two nodes fit in a cache line
+	struct bvh_node
+	{
+		aabb bounds;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	static_assert(sizeof(bvh_node) == 32);
+
+	// Two sibling nodes in 20 bytes instead of 64. Their boxes are stored in 1/255 steps of the box of their
+	// parent, rounded outward: the minimums counted up from the parent minimum and the maximums down from
+	// the parent maximum, so that the decoded box never misses a primitive. Every node packs its count into
+	// the low bits of its `first`
+	struct quantized_node_pair
+	{
+		static constexpr uint32_t count_bits = 4;
+		static constexpr float steps = 255.f;
+
+		uint8_t bounds[2][6];
+		uint32_t nodes[2];
+
+		void set_node(size_t side, const bvh_node& node, const aabb& parent);
+		aabb get_bounds(size_t side, const aabb& parent) const;
+		// Both boxes at once, sharing the steps
+		void get_bounds(const aabb& parent, aabb& left, aabb& right) const;
+		uint32_t get_first(size_t side) const;
+		uint32_t get_count(size_t side) const;
+
+	protected:
+		static float get_min_plane(float parent_min, float step, uint8_t steps_up);
+		static float get_max_plane(float parent_max, float step, uint8_t steps_down);
+	};
+
+	static_assert(sizeof(quantized_node_pair) == 20);
+
+	enum class bvh_builder
+	{
+		sah,
+		sbvh,
+		lbvh
+	};
+
+	// Work done by traversals, summed over the rays that did it. Only counted in builds with
+	// CG_TRAVERSAL_STATS defined, to keep the increments off the traversal loops otherwise
+	struct traversal_stats
+	{
+#ifdef CG_TRAVERSAL_STATS
+		static constexpr bool is_counted = true;
+#else
+		static constexpr bool is_counted = false;
+#endif
+		uint64_t nodes = 0;
+		uint64_t leaves = 0;
+
+		void add_node()
+		{
+			if constexpr (is_counted) nodes++;
+		}
+		void add_leaf()
+		{
+			if constexpr (is_counted) leaves++;
+		}
+	};
+
+	// Bounding volume hierarchy over a set of boxes, split by the surface area heuristic evaluated over
+	// bins of the centroids ("On fast Construction of SAH-based Bounding Volume Hierarchies", Wald 2007).
+	// Knows nothing about what the boxes hold: the owner reorders its primitives after `get_primitive_order`
+	// so that every leaf covers a contiguous range of them
+	class bvh
+	{
+	public:
+		// Marks the positions of the leaf ranges that only pad a leaf to a whole block
+		static constexpr uint32_t padding = std::numeric_limits<uint32_t>::max();
+
+		// Primitives tested `block_size` at a time are priced by the block, and every leaf range starts
+		// on a block, its last block filled with `padding`
+		void build(const std::vector<aabb>& primitive_bounds, size_t block_size = 1);
+		// Bounds of the parts of a primitive on either side of the plane where `axis` is `position`, within
+		// `bounds`, the part of the primitive that the box holds
+		using split_function = std::function<void(uint32_t primitive, const aabb& bounds, int axis, float position, aabb& left, aabb& right)>;
+		// Builds a spatial split BVH ("Spatial Splits in Bounding Volume Hierarchies", Stich et al. 2009).
+		// Besides sorting the primitives to either child, a node may be cut by a plane, and the primitives
+		// it crosses go to both children with clipped boxes. Large primitives that make the children of
+		// object splits overlap stop dragging rays into both. The same primitive then appears in several
+		// leaves, up to `memory_budget` references per primitive in total
+		void build_spatial(const std::vector<aabb>& primitive_bounds, const split_function& split_primitive, float memory_budget, size_t block_size = 1);
+		// Builds a linear BVH ("Fast BVH Construction on GPUs", Lauterbach et al. 2009) in a fraction of the
+		// time of the binned SAH, for a looser tree. The centroids are sorted along a Morton curve, and every
+		// node splits its range where the highest bit that differs between its codes turns on. Small
+		// subtrees are collapsed into leaves where the SAH prices a leaf lower
+		void build_linear(const std::vector<aabb>& primitive_bounds, size_t block_size = 1);
+		// Primitives from which `build_linear` spreads its work over the threads
+		static constexpr size_t min_parallel_primitives = 1 << 14;
+		// Updates the bounds of the nodes bottom-up for primitives that moved, keeping the topology.
+		// `primitive_bounds` are in leaf order, that is indexed like the leaf ranges
+		void refit(const std::vector<aabb>& primitive_bounds);
+		// Expected cost of tracing a ray through the tree, relative to testing one primitive
+		float get_sah_cost() const;
+		// The cost right after the last build. Refitting moving primitives makes the boxes overlap,
+		// and the cost grows from there
+		float get_built_sah_cost() const;
+		// Traverses nodes owned by someone else, such as a mapped cache file, instead of building them
+		void attach(const bvh_node* in_nodes, size_t in_node_count, size_t in_block_size = 1);
+		// Replaces the nodes below the root by quantized pairs, about a third of their size, for slightly
+		// looser boxes decoded during traversal. Returns false, keeping the full nodes, if a leaf has too
+		// many primitives to pack. Refitting decodes the nodes and quantizes them again
+		bool quantize();
+		bool is_quantized() const;
+
+		bool is_empty() const;
+		aabb get_bounds() const;
+		// The full nodes, only the root of a quantized hierarchy
+		const bvh_node* get_nodes() const;
+		const std::vector<quantized_node_pair>& get_quantized_nodes() const;
+		// Every node, decoded from the quantized pairs if need be
+		std::vector<bvh_node> decode_nodes() const;
+		size_t get_node_count() const;
+		size_t get_memory_size() const;
+		// Original index of the primitive at every position of the leaf ranges, or `padding`
+		const std::vector<uint32_t>& get_primitive_order() const;
+		// Parameters that the shape of the tree depends on, to key caches of it
+		static std::array<float, 5> get_build_settings();
+
+		// Calls `visit_leaf(first, count)` for every leaf the ray enters within [min_t, max_t], the nearer
+		// child first. `max_t` is read again before every node, so that the leaves can shrink it as they
+		// find closer hits. The nodes entered are counted into `stats`
+		template<typename F>
+		void traverse(float3 position, float3 direction, const float& max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const;
+		// Visits the leaves until `visit_leaf(first, count)` returns true. Any hit will do, so the child with
+		// the larger surface area, the one more likely to block the ray, goes first
+		template<typename F>
+		bool traverse_any(float3 position, float3 direction, float max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const;
+
+	protected:
+		static constexpr size_t bin_count = 16;
+		static constexpr size_t max_leaf_size = 4;
+		static constexpr size_t max_depth = 60;
+		// Costs of a node visit and of a primitive test, relative to each other
+		static constexpr float traversal_cost = 1.f;
+		static constexpr float intersection_cost = 1.f;
+
+		std::vector<bvh_node> nodes;
+		std::vector<quantized_node_pair> quantized_nodes;
+		std::vector<uint32_t> primitive_order;
+		size_t block_size = 1;
+		const bvh_node* attached_nodes = nullptr;
+		size_t attached_node_count = 0;
+		float built_sah_cost = 0.f;
+		// The nodes grouped by depth, from the root down, for refitting one level at a time
+		std::vector<uint32_t> level_nodes;
+		std::vector<size_t> level_offsets;
+
+		// A primitive, or the part of it inside `bounds` after spatial splits
+		struct reference
+		{
+			aabb bounds;
+			uint32_t primitive;
+		};
+
+		struct spatial_build
+		{
+			const split_function& split_primitive;
+			float root_area;
+			size_t reference_count;
+			size_t max_reference_count;
+		};
+
+		// Overlap of the children of an object split, relative to the root, below which spatial splits
+		// aren't tried
+		static constexpr float spatial_split_overlap = 1e-5f;
+		// Bits of every coordinate in the Morton codes of the linear builder
+		static constexpr int morton_bits = 10;
+
+		void reset(size_t in_block_size);
+		float get_leaf_cost(size_t count) const;
+		void subdivide(uint32_t node_id, const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids, size_t depth);
+		void subdivide_spatial(uint32_t node_id, std::vector<reference>& references, spatial_build& build, size_t depth);
+		void make_leaf(uint32_t node_id, const std::vector<reference>& references);
+		float subdivide_linear(uint32_t node_id, const std::vector<aabb>& primitive_bounds, const std::vector<uint32_t>& codes, size_t depth);
+		static uint32_t get_morton_code(float3 position);
+		static void sort_by_code(std::vector<uint32_t>& codes, std::vector<uint32_t>& order);
+		void align_leaves();
+
+		template<typename F>
+		void traverse_quantized(float3 position, float3 direction, const float& max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const;
+		template<typename F>
+		bool traverse_any_quantized(float3 position, float3 direction, float max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const;
+	};
+
+	inline aabb::aabb(float3 in_min, float3 in_max) : aabb_min(in_min), aabb_max(in_max) {}
+
+	inline void aabb::add_point(float3 point)
+	{
+		aabb_min = min(aabb_min, point);
+		aabb_max = max(aabb_max, point);
+	}
+
+	inline void aabb::add_aabb(const aabb& other)
+	{
+		aabb_min = min(aabb_min, other.aabb_min);
+		aabb_max = max(aabb_max, other.aabb_max);
+	}
+
+	inline bool aabb::is_empty() const { return aabb_min.x > aabb_max.x; }
+
+	inline float aabb::get_area() const
+	{
+		if (is_empty()) return 0.f;
+		float3 extent = aabb_max - aabb_min;
+		return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+
+	inline float3 aabb::get_center() const { return (aabb_min + aabb_max) * 0.5f; }
+
+	inline float3 aabb::get_min() const { return aabb_min; }
+
+	inline float3 aabb::get_max() const { return aabb_max; }
+
+	inline void aabb::clip(const aabb& other)
+	{
+		aabb_min = max(aabb_min, other.aabb_min);
+		aabb_max = min(aabb_max, other.aabb_max);
+		if (aabb_min.x > aabb_max.x || aabb_min.y > aabb_max.y || aabb_min.z > aabb_max.z) *this = aabb{};
+	}
+
+	// The planes are decoded one by one in the same way when set and when traversed, so that a plane checked
+	// to cover the node while encoding covers it during traversal
+	inline float quantized_node_pair::get_min_plane(float parent_min, float step, uint8_t steps_up) { return parent_min + static_cast<float>(steps_up) * step; }
+
+	inline float quantized_node_pair::get_max_plane(float parent_max, float step, uint8_t steps_down) { return parent_max - static_cast<float>(steps_down) * step; }
+
+	// Starts from the rounded quotient and moves to the tightest plane that still covers the node. A node
+	// with an empty box gets planes crossed over, an empty box unless the parent is flat
+	inline void quantized_node_pair::set_node(size_t side, const bvh_node& node, const aabb& parent)
+	{
+		nodes[side] = node.first << count_bits | node.count;
+		float3 step = (parent.get_max() - parent.get_min()) * (1.f / steps);
+		for (int axis = 0; axis < 3; axis++) {
+			float parent_min = parent.get_min()[axis], parent_max = parent.get_max()[axis];
+			float node_min = node.bounds.get_min()[axis], node_max = node.bounds.get_max()[axis];
+			if (!(step[axis] > 0)) {
+				bounds[side][axis] = 0;
+				bounds[side][axis + 3] = 0;
+				continue;
+			}
+
+			uint8_t up = static_cast<uint8_t>(std::clamp(std::floor((node_min - parent_min) / step[axis]), 0.f, steps));
+			while (up < steps && get_min_plane(parent_min, step[axis], up + 1) <= node_min) up++;
+			while (up > 0 && get_min_plane(parent_min, step[axis], up) > node_min) up--;
+			uint8_t down = static_cast<uint8_t>(std::clamp(std::floor((parent_max - node_max) / step[axis]), 0.f, steps));
+			while (down < steps && get_max_plane(parent_max, step[axis], down + 1) >= node_max) down++;
+			while (down > 0 && get_max_plane(parent_max, step[axis], down) < node_max) down--;
+			bounds[side][axis] = up;
+			bounds[side][axis + 3] = down;
+		}
+	}
+
+	inline aabb quantized_node_pair::get_bounds(size_t side, const aabb& parent) const
+	{
+		float3 parent_min = parent.get_min(), parent_max = parent.get_max();
+		float3 step = (parent_max - parent_min) * (1.f / steps);
+		float3 node_min, node_max;
+		for (int axis = 0; axis < 3; axis++) {
+			node_min[axis] = get_min_plane(parent_min[axis], step[axis], bounds[side][axis]);
+			node_max[axis] = get_max_plane(parent_max[axis], step[axis], bounds[side][axis + 3]);
+		}
+		return aabb(node_min, node_max);
+	}
+
+	inline void quantized_node_pair::get_bounds(const aabb& parent, aabb& left, aabb& right) const
+	{
+		float3 parent_min = parent.get_min(), parent_max = parent.get_max();
+		float3 step = (parent_max - parent_min) * (1.f / steps);
+		float3 left_min, left_max, right_min, right_max;
+		for (int axis = 0; axis < 3; axis++) {
+			left_min[axis] = get_min_plane(parent_min[axis], step[axis], bounds[0][axis]);
+			left_max[axis] = get_max_plane(parent_max[axis], step[axis], bounds[0][axis + 3]);
+			right_min[axis] = get_min_plane(parent_min[axis], step[axis], bounds[1][axis]);
+			right_max[axis] = get_max_plane(parent_max[axis], step[axis], bounds[1][axis + 3]);
+		}
+		left = aabb(left_min, left_max);
+		right = aabb(right_min, right_max);
+	}
+
+	inline uint32_t quantized_node_pair::get_first(size_t side) const { return nodes[side] >> count_bits; }
+
+	inline uint32_t quantized_node_pair::get_count(size_t side) const { return nodes[side] & ((1u << count_bits) - 1); }
+
+	// Slab test written so that a NaN from an axis-parallel ray lying in a slab plane keeps the box
+	// instead of culling it
+	inline float aabb::intersect(float3 position, float3 inv_direction, float max_t, float min_t) const
+	{
+		float3 t0 = (aabb_max - position) * inv_direction;
+		float3 t1 = (aabb_min - position) * inv_direction;
+
+		float t_near = maxelem(min(t0, t1));
+		float t_far = minelem(max(t0, t1));
+		if (t_near > t_far || t_far < min_t || t_near > max_t) return std::numeric_limits<float>::infinity();
+		return t_near > min_t ? t_near : min_t;
+	}
+
+	inline void bvh::reset(size_t in_block_size)
+	{
+		block_size = in_block_size;
+		attached_nodes = nullptr;
+		attached_node_count = 0;
+		level_nodes.clear();
+		level_offsets.clear();
+		nodes.clear();
+		quantized_nodes.clear();
+		primitive_order.clear();
+	}
+
+	inline void bvh::build(const std::vector<aabb>& primitive_bounds, size_t in_block_size)
+	{
+		reset(in_block_size);
+		primitive_order.resize(primitive_bounds.size());
+		std::iota(primitive_order.begin(), primitive_order.end(), 0);
+		if (primitive_bounds.empty()) return;
+
+		std::vector<float3> centroids(primitive_bounds.size());
+		for (size_t i = 0; i < primitive_bounds.size(); i++) centroids[i] = primitive_bounds[i].get_center();
+
+		nodes.reserve(2 * primitive_bounds.size());
+		nodes.push_back({ aabb{}, 0, static_cast<uint32_t>(primitive_bounds.size()) });
+		subdivide(0, primitive_bounds, centroids, 0);
+		nodes.shrink_to_fit();
+		if (block_size > 1) align_leaves();
+		built_sah_cost = get_sah_cost();
+	}
+
+	inline void bvh::build_spatial(const std::vector<aabb>& primitive_bounds, const split_function& split_primitive, float memory_budget, size_t in_block_size)
+	{
+		reset(in_block_size);
+		if (primitive_bounds.empty()) return;
+
+		std::vector<reference> references(primitive_bounds.size());
+		aabb bounds;
+		for (uint32_t i = 0; i < primitive_bounds.size(); i++) {
+			references[i] = { primitive_bounds[i], i };
+			bounds.add_aabb(primitive_bounds[i]);
+		}
+		size_t max_reference_count = std::max(primitive_bounds.size(), static_cast<size_t>(primitive_bounds.size() * memory_budget));
+		spatial_build build{ split_primitive, bounds.get_area(), primitive_bounds.size(), max_reference_count };
+
+		primitive_order.reserve(max_reference_count);
+		nodes.reserve(2 * max_reference_count);
+		nodes.push_back({ aabb{}, 0, 0 });
+		subdivide_spatial(0, references, build, 0);
+		nodes.shrink_to_fit();
+		primitive_order.shrink_to_fit();
+		if (block_size > 1) align_leaves();
+		built_sah_cost = get_sah_cost();
+	}
+
+	inline void bvh::build_linear(const std::vector<aabb>& primitive_bounds, size_t in_block_size)
+	{
+		reset(in_block_size);
+		primitive_order.resize(primitive_bounds.size());
+		std::iota(primitive_order.begin(), primitive_order.end(), 0);
+		if (primitive_bounds.empty()) return;
+
+		aabb centroid_bounds;
+		for (const aabb& bounds : primitive_bounds) centroid_bounds.add_point(bounds.get_center());
+		float3 centroid_min = centroid_bounds.get_min();
+		float3 centroid_extent = centroid_bounds.get_max() - centroid_min;
+		float3 scale{ 0.f };
+		for (int axis = 0; axis < 3; axis++) {
+			if (centroid_extent[axis] > 0) scale[axis] = 1.f / centroid_extent[axis];
+		}
+
+		int count = static_cast<int>(primitive_bounds.size());
+		std::vector<uint32_t> codes(primitive_bounds.size());
+		#pragma omp parallel for if (primitive_bounds.size() >= min_parallel_primitives)
+		for (int i = 0; i < count; i++) codes[i] = get_morton_code((primitive_bounds[i].get_center() - centroid_min) * scale);
+		sort_by_code(codes, primitive_order);
+
+		nodes.reserve(2 * primitive_bounds.size());
+		nodes.push_back({ aabb{}, 0, static_cast<uint32_t>(primitive_bounds.size()) });
+		subdivide_linear(0, primitive_bounds, codes, 0);
+		nodes.shrink_to_fit();
+		if (block_size > 1) align_leaves();
+		built_sah_cost = get_sah_cost();
+	}
+
+	// The nodes of a level only depend on the level below, so each level is updated in parallel
+	inline void bvh::refit(const std::vector<aabb>& primitive_bounds)
+	{
+		if (attached_nodes) THROW_ERROR("Can't refit a hierarchy attached from a cache");
+		if (nodes.empty()) return;
+		bool was_quantized = is_quantized();
+		if (was_quantized) {
+			nodes = decode_nodes();
+			std::vector<quantized_node_pair>().swap(quantized_nodes);
+		}
+
+		if (level_nodes.empty()) {
+			level_nodes.push_back(0);
+			level_offsets = { 0, 1 };
+			while (level_offsets.back() > level_offsets[level_offsets.size() - 2]) {
+				for (size_t i = level_offsets[level_offsets.size() - 2]; i < level_offsets.back(); i++) {
+					const bvh_node& node = nodes[level_nodes[i]];
+					if (node.count > 0) continue;
+					level_nodes.push_back(node.first);
+					level_nodes.push_back(node.first + 1);
+				}
+				level_offsets.push_back(level_nodes.size());
+			}
+		}
+
+		constexpr int min_parallel_nodes = 1024;
+		for (size_t level = level_offsets.size() - 1; level-- > 0;) {
+			int level_begin = static_cast<int>(level_offsets[level]);
+			int level_end = static_cast<int>(level_offsets[level + 1]);
+			#pragma omp parallel for if (level_end - level_begin >= min_parallel_nodes)
+			for (int i = level_begin; i < level_end; i++) {
+				bvh_node& node = nodes[level_nodes[i]];
+				aabb bounds;
+				if (node.count > 0) {
+					for (uint32_t primitive = node.first; primitive < node.first + node.count; primitive++) bounds.add_aabb(primitive_bounds[primitive]);
+				} else {
+					bounds.add_aabb(nodes[node.first].bounds);
+					bounds.add_aabb(nodes[node.first + 1].bounds);
+				}
+				node.bounds = bounds;
+			}
+		}
+		if (was_quantized) quantize();
+	}
+
+	inline float bvh::get_sah_cost() const
+	{
+		if (is_empty()) return 0.f;
+		std::vector<bvh_node> decoded_nodes;
+		if (is_quantized()) decoded_nodes = decode_nodes();
+		const bvh_node* nodes = is_quantized() ? decoded_nodes.data() : get_nodes();
+		float cost = 0.f;
+		for (size_t i = 0; i < get_node_count(); i++) {
+			float area = nodes[i].bounds.get_area();
+			cost += nodes[i].count > 0 ? get_leaf_cost(nodes[i].count) * area : traversal_cost * area;
+		}
+		return cost / std::max(nodes[0].bounds.get_area(), std::numeric_limits<float>::min());
+	}
+
+	inline float bvh::get_built_sah_cost() const { return built_sah_cost; }
+
+	inline float bvh::get_leaf_cost(size_t count) const { return intersection_cost * static_cast<float>((count + block_size - 1) / block_size); }
+
+	inline void bvh::subdivide(uint32_t node_id, const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids, size_t depth)
+	{
+		uint32_t first = nodes[node_id].first;
+		uint32_t count = nodes[node_id].count;
+
+		aabb bounds, centroid_bounds;
+		for (uint32_t i = first; i < first + count; i++) {
+			bounds.add_aabb(primitive_bounds[primitive_order[i]]);
+			centroid_bounds.add_point(centroids[primitive_order[i]]);
+		}
+		nodes[node_id].bounds = bounds;
+		if (count <= 1 || depth >= max_depth) return;
+
+		// Sweeps the bins of every axis from both sides to price all the split planes between them
+		float3 centroid_min = centroid_bounds.get_min();
+		float3 centroid_extent = centroid_bounds.get_max() - centroid_min;
+		float best_cost = std::numeric_limits<float>::infinity();
+		int best_axis = -1;
+		size_t best_split = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			if (centroid_extent[axis] <= 0) continue;
+			float scale = bin_count / centroid_extent[axis];
+
+			std::array<aabb, bin_count> bin_bounds;
+			std::array<uint32_t, bin_count> bin_counts{};
+			for (uint32_t i = first; i < first + count; i++) {
+				uint32_t primitive = primitive_order[i];
+				size_t bin = std::min(static_cast<size_t>((centroids[primitive][axis] - centroid_min[axis]) * scale), bin_count - 1);
+				bin_bounds[bin].add_aabb(primitive_bounds[primitive]);
+				bin_counts[bin]++;
+			}
+
+			std::array<float, bin_count - 1> left_costs;
+			aabb left_bounds;
+			uint32_t left_count = 0;
+			for (size_t split = 0; split < bin_count - 1; split++) {
+				left_bounds.add_aabb(bin_bounds[split]);
+				left_count += bin_counts[split];
+				left_costs[split] = get_leaf_cost(left_count) * left_bounds.get_area();
+			}
+			aabb right_bounds;
+			uint32_t right_count = 0;
+			for (size_t split = bin_count - 1; split > 0; split--) {
+				right_bounds.add_aabb(bin_bounds[split]);
+				right_count += bin_counts[split];
+				float cost = left_costs[split - 1] + get_leaf_cost(right_count) * right_bounds.get_area();
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+				}
+			}
+		}
+
+		float area = bounds.get_area();
+		float leaf_cost = get_leaf_cost(count);
+		float split_cost = traversal_cost + best_cost / std::max(area, std::numeric_limits<float>::min());
+		if (count <= max_leaf_size && (best_axis < 0 || split_cost >= leaf_cost)) return;
+
+		uint32_t* begin = primitive_order.data() + first;
+		uint32_t* end = begin + count;
+		uint32_t* middle = begin;
+		if (best_axis >= 0) {
+			float scale = bin_count / centroid_extent[best_axis];
+			middle = std::partition(begin, end, [&](uint32_t primitive) {
+				size_t bin = std::min(static_cast<size_t>((centroids[primitive][best_axis] - centroid_min[best_axis]) * scale), bin_count - 1);
+				return bin < best_split;
+			});
+		}
+		// Primitives sharing a centroid can't be told apart by a plane, they're halved to bound the leaf size
+		if (middle == begin || middle == end) middle = begin + count / 2;
+
+		uint32_t left_count = static_cast<uint32_t>(middle - begin);
+		uint32_t children = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({ aabb{}, first, left_count });
+		nodes.push_back({ aabb{}, first + left_count, count - left_count });
+		nodes[node_id].first = children;
+		nodes[node_id].count = 0;
+
+		subdivide(children, primitive_bounds, centroids, depth + 1);
+		subdivide(children + 1, primitive_bounds, centroids, depth + 1);
+	}
+
+	// The references of a node are split into vectors for its children, and its leaves are appended to
+	// the primitive order as the recursion reaches them, left to right
+	inline void bvh::subdivide_spatial(uint32_t node_id, std::vector<reference>& references, spatial_build& build, size_t depth)
+	{
+		aabb bounds, centroid_bounds;
+		for (const reference& reference : references) {
+			bounds.add_aabb(reference.bounds);
+			centroid_bounds.add_point(reference.bounds.get_center());
+		}
+		nodes[node_id].bounds = bounds;
+		size_t count = references.size();
+		if (count <= 1 || depth >= max_depth) {
+			make_leaf(node_id, references);
+			return;
+		}
+
+		// The binned object split, as in `subdivide`, remembering the boxes of the best children
+		float3 centroid_min = centroid_bounds.get_min();
+		float3 centroid_extent = centroid_bounds.get_max() - centroid_min;
+		float object_cost = std::numeric_limits<float>::infinity();
+		int object_axis = -1;
+		size_t object_split = 0;
+		aabb object_left, object_right;
+		for (int axis = 0; axis < 3; axis++) {
+			if (centroid_extent[axis] <= 0) continue;
+			float scale = bin_count / centroid_extent[axis];
+
+			std::array<aabb, bin_count> bin_bounds;
+			std::array<uint32_t, bin_count> bin_counts{};
+			for (const reference& reference : references) {
+				size_t bin = std::min(static_cast<size_t>((reference.bounds.get_center()[axis] - centroid_min[axis]) * scale), bin_count - 1);
+				bin_bounds[bin].add_aabb(reference.bounds);
+				bin_counts[bin]++;
+			}
+
+			std::array<aabb, bin_count - 1> left_bounds;
+			std::array<uint32_t, bin_count - 1> left_counts;
+			aabb left;
+			uint32_t left_count = 0;
+			for (size_t split = 0; split < bin_count - 1; split++) {
+				left.add_aabb(bin_bounds[split]);
+				left_count += bin_counts[split];
+				left_bounds[split] = left;
+				left_counts[split] = left_count;
+			}
+			aabb right;
+			uint32_t right_count = 0;
+			for (size_t split = bin_count - 1; split > 0; split--) {
+				right.add_aabb(bin_bounds[split]);
+				right_count += bin_counts[split];
+				float cost = get_leaf_cost(left_counts[split - 1]) * left_bounds[split - 1].get_area() + get_leaf_cost(right_count) * right.get_area();
+				if (cost < object_cost) {
+					object_cost = cost;
+					object_axis = axis;
+					object_split = split;
+					object_left = left_bounds[split - 1];
+					object_right = right;
+				}
+			}
+		}
+
+		// Spatial splits are only worth pricing where the children of the object split overlap. The bins
+		// cover the node box, every reference is chopped along the bins it spans, and it enters the sweep
+		// once from each side
+		float spatial_cost = std::numeric_limits<float>::infinity();
+		int spatial_axis = -1;
+		size_t spatial_split = 0;
+		aabb overlap = object_left;
+		overlap.clip(object_right);
+		bool try_spatial = object_axis < 0 || overlap.get_area() > spatial_split_overlap * build.root_area;
+		if (try_spatial && build.reference_count < build.max_reference_count) {
+			for (int axis = 0; axis < 3; axis++) {
+				float extent = bounds.get_max()[axis] - bounds.get_min()[axis];
+				if (extent <= 0) continue;
+				float bin_width = extent / bin_count;
+				auto get_bin = [&](float position) {
+					return std::min(static_cast<size_t>(std::max((position - bounds.get_min()[axis]) / bin_width, 0.f)), bin_count - 1);
+				};
+
+				std::array<aabb, bin_count> bin_bounds;
+				std::array<uint32_t, bin_count> entries{}, exits{};
+				for (const reference& reference : references) {
+					size_t first_bin = get_bin(reference.bounds.get_min()[axis]);
+					size_t last_bin = get_bin(reference.bounds.get_max()[axis]);
+					entries[first_bin]++;
+					exits[last_bin]++;
+					aabb rest = reference.bounds;
+					for (size_t bin = first_bin; bin < last_bin; bin++) {
+						aabb left, right;
+						build.split_primitive(reference.primitive, rest, axis, bounds.get_min()[axis] + (bin + 1) * bin_width, left, right);
+						bin_bounds[bin].add_aabb(left);
+						rest = right;
+					}
+					bin_bounds[last_bin].add_aabb(rest);
+				}
+
+				std::array<float, bin_count - 1> left_costs;
+				aabb left;
+				uint32_t left_count = 0;
+				for (size_t split = 0; split < bin_count - 1; split++) {
+					left.add_aabb(bin_bounds[split]);
+					left_count += entries[split];
+					left_costs[split] = get_leaf_cost(left_count) * left.get_area();
+				}
+				aabb right;
+				uint32_t right_count = 0;
+				for (size_t split = bin_count - 1; split > 0; split--) {
+					right.add_aabb(bin_bounds[split]);
+					right_count += exits[split];
+					float cost = left_costs[split - 1] + get_leaf_cost(right_count) * right.get_area();
+					if (cost < spatial_cost) {
+						spatial_cost = cost;
+						spatial_axis = axis;
+						spatial_split = split;
+					}
+				}
+			}
+		}
+
+		float area = std::max(bounds.get_area(), std::numeric_limits<float>::min());
+		float leaf_cost = get_leaf_cost(count);
+		float split_cost = traversal_cost + std::min(object_cost, spatial_cost) / area;
+		if (count <= max_leaf_size && split_cost >= leaf_cost) {
+			make_leaf(node_id, references);
+			return;
+		}
+
+		std::vector<reference> left_references, right_references;
+		if (spatial_cost < object_cost) {
+			float plane = bounds.get_min()[spatial_axis] + spatial_split * ((bounds.get_max()[spatial_axis] - bounds.get_min()[spatial_axis]) / bin_count);
+			size_t crossing = 0;
+			for (const reference& reference : references) {
+				crossing += reference.bounds.get_min()[spatial_axis] < plane && reference.bounds.get_max()[spatial_axis] > plane;
+			}
+			// A split that would break the budget falls back to the object split
+			if (build.reference_count + crossing <= build.max_reference_count) {
+				for (const reference& reference : references) {
+					if (reference.bounds.get_max()[spatial_axis] <= plane) {
+						left_references.push_back(reference);
+					} else if (reference.bounds.get_min()[spatial_axis] >= plane) {
+						right_references.push_back(reference);
+					} else {
+						aabb left, right;
+						build.split_primitive(reference.primitive, reference.bounds, spatial_axis, plane, left, right);
+						if (!left.is_empty()) left_references.push_back({ left, reference.primitive });
+						if (!right.is_empty()) right_references.push_back({ right, reference.primitive });
+						build.reference_count += !left.is_empty() && !right.is_empty();
+					}
+				}
+				// Only a reference that went to both sides was counted, and then neither side is empty
+				if (left_references.empty() || right_references.empty()) {
+					left_references.clear();
+					right_references.clear();
+				}
+			}
+		}
+		if (left_references.empty() && right_references.empty()) {
+			auto middle = references.begin();
+			if (object_axis >= 0) {
+				float scale = bin_count / centroid_extent[object_axis];
+				middle = std::partition(references.begin(), references.end(), [&](const reference& reference) {
+					size_t bin = std::min(static_cast<size_t>((reference.bounds.get_center()[object_axis] - centroid_min[object_axis]) * scale), bin_count - 1);
+					return bin < object_split;
+				});
+			}
+			// References sharing a centroid can't be told apart by a plane, they're halved to bound the leaf size
+			if (middle == references.begin() || middle == references.end()) middle = references.begin() + count / 2;
+			left_references.assign(references.begin(), middle);
+			right_references.assign(middle, references.end());
+		}
+		std::vector<reference>().swap(references);
+
+		uint32_t children = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({ aabb{}, 0, 0 });
+		nodes.push_back({ aabb{}, 0, 0 });
+		nodes[node_id].first = children;
+		nodes[node_id].count = 0;
+
+		subdivide_spatial(children, left_references, build, depth + 1);
+		subdivide_spatial(children + 1, right_references, build, depth + 1);
+	}
+
+	inline void bvh::make_leaf(uint32_t node_id, const std::vector<reference>& references)
+	{
+		nodes[node_id].first = static_cast<uint32_t>(primitive_order.size());
+		nodes[node_id].count = static_cast<uint32_t>(references.size());
+		for (const reference& reference : references) primitive_order.push_back(reference.primitive);
+	}
+
+	// `codes` are those of the primitives in `primitive_order`, sorted. Returns the cost of the subtree as
+	// `get_sah_cost` sums it, before dividing by the area of the root
+	inline float bvh::subdivide_linear(uint32_t node_id, const std::vector<aabb>& primitive_bounds, const std::vector<uint32_t>& codes, size_t depth)
+	{
+		uint32_t first = nodes[node_id].first;
+		uint32_t count = nodes[node_id].count;
+		// No split is cheaper than a leaf that fits in one block
+		if (count <= block_size || depth >= max_depth) {
+			aabb bounds;
+			for (uint32_t i = first; i < first + count; i++) bounds.add_aabb(primitive_bounds[primitive_order[i]]);
+			nodes[node_id].bounds = bounds;
+			return get_leaf_cost(count) * bounds.get_area();
+		}
+
+		// The codes of the range share every bit above the highest one that differs between its ends, so
+		// the ones with that bit off come first. Primitives sharing a code are halved
+		uint32_t left_count = count / 2;
+		uint32_t differing = codes[first] ^ codes[first + count - 1];
+		if (differing != 0) {
+			uint32_t bit = 1u << 31;
+			while (!(differing & bit)) bit >>= 1;
+			auto begin = codes.begin() + first;
+			left_count = static_cast<uint32_t>(std::partition_point(begin, begin + count, [&](uint32_t code) { return !(code & bit); }) - begin);
+		}
+
+		uint32_t children = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({ aabb{}, first, left_count });
+		nodes.push_back({ aabb{}, first + left_count, count - left_count });
+		float children_cost = subdivide_linear(children, primitive_bounds, codes, depth + 1);
+		children_cost += subdivide_linear(children + 1, primitive_bounds, codes, depth + 1);
+
+		aabb bounds = nodes[children].bounds;
+		bounds.add_aabb(nodes[children + 1].bounds);
+		float area = bounds.get_area();
+		float split_cost = traversal_cost * area + children_cost;
+		float leaf_cost = get_leaf_cost(count) * area;
+		if (count > max_leaf_size || split_cost < leaf_cost) {
+			nodes[node_id] = { bounds, children, 0 };
+			return split_cost;
+		}
+		// The subtree was the last to be appended
+		nodes.resize(children);
+		nodes[node_id] = { bounds, first, count };
+		return leaf_cost;
+	}
+
+	// Interleaves the bits of the coordinates, given within [0, 1]
+	inline uint32_t bvh::get_morton_code(float3 position)
+	{
+		constexpr float max_cell = static_cast<float>((1 << morton_bits) - 1);
+		uint32_t code = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			uint32_t cell = static_cast<uint32_t>(std::clamp(position[axis] * max_cell, 0.f, max_cell));
+			for (int bit = 0; bit < morton_bits; bit++) code |= ((cell >> bit) & 1) << (bit * 3 + axis);
+		}
+		return code;
+	}
+
+	// Sorts the codes and `order` with them by an LSD radix sort. Every pass is stable: the chunks count
+	// their digits in parallel, then scatter in parallel, each after the same digits of the chunks before
+	inline void bvh::sort_by_code(std::vector<uint32_t>& codes, std::vector<uint32_t>& order)
+	{
+		constexpr int digit_bits = 8;
+		constexpr size_t digit_count = 1 << digit_bits;
+		constexpr size_t chunk_size = 1 << 14;
+		size_t count = codes.size();
+		int chunk_count = static_cast<int>((count + chunk_size - 1) / chunk_size);
+
+		std::vector<uint32_t> sorted_codes(count), sorted_order(count);
+		std::vector<std::array<size_t, digit_count>> offsets(chunk_count);
+		for (int shift = 0; shift < 3 * morton_bits; shift += digit_bits) {
+			#pragma omp parallel for if (chunk_count > 1)
+			for (int chunk = 0; chunk < chunk_count; chunk++) {
+				offsets[chunk].fill(0);
+				size_t end = std::min(count, (chunk + 1) * chunk_size);
+				for (size_t i = chunk * chunk_size; i < end; i++) offsets[chunk][(codes[i] >> shift) & (digit_count - 1)]++;
+			}
+
+			size_t offset = 0;
+			for (size_t digit = 0; digit < digit_count; digit++) {
+				for (auto& chunk_offsets : offsets) {
+					size_t chunk_digits = chunk_offsets[digit];
+					chunk_offsets[digit] = offset;
+					offset += chunk_digits;
+				}
+			}
+
+			#pragma omp parallel for if (chunk_count > 1)
+			for (int chunk = 0; chunk < chunk_count; chunk++) {
+				size_t end = std::min(count, (chunk + 1) * chunk_size);
+				for (size_t i = chunk * chunk_size; i < end; i++) {
+					size_t position = offsets[chunk][(codes[i] >> shift) & (digit_count - 1)]++;
+					sorted_codes[position] = codes[i];
+					sorted_order[position] = order[i];
+				}
+			}
+			codes.swap(sorted_codes);
+			order.swap(sorted_order);
+		}
+	}
+
+	// Moves the leaf ranges apart, in the order of the primitives, so that each of them starts on a block
+	inline void bvh::align_leaves()
+	{
+		std::vector<uint32_t> leaves;
+		for (uint32_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].count > 0) leaves.push_back(i);
+		}
+		std::sort(leaves.begin(), leaves.end(), [&](uint32_t a, uint32_t b) { return nodes[a].first < nodes[b].first; });
+
+		std::vector<uint32_t> aligned_order;
+		aligned_order.reserve(primitive_order.size() + leaves.size() * (block_size - 1));
+		for (uint32_t leaf : leaves) {
+			bvh_node& node = nodes[leaf];
+			uint32_t first = static_cast<uint32_t>(aligned_order.size());
+			aligned_order.insert(aligned_order.end(), primitive_order.begin() + node.first, primitive_order.begin() + node.first + node.count);
+			aligned_order.resize((aligned_order.size() + block_size - 1) / block_size * block_size, padding);
+			node.first = first;
+		}
+		primitive_order.swap(aligned_order);
+	}
+
+	inline void bvh::attach(const bvh_node* in_nodes, size_t in_node_count, size_t in_block_size)
+	{
+		block_size = in_block_size;
+		nodes.clear();
+		quantized_nodes.clear();
+		primitive_order.clear();
+		attached_nodes = in_nodes;
+		attached_node_count = in_node_count;
+		built_sah_cost = get_sah_cost();
+	}
+
+	// The children of every interior node are pairs at odd positions, the pair after the root first, so a
+	// pair is found at half the position of its first node. The boxes are quantized from the root down,
+	// each within the decoded box of its parent that traversal will see
+	inline bool bvh::quantize()
+	{
+		if (is_empty() || is_quantized()) return true;
+		const bvh_node* full_nodes = get_nodes();
+		size_t node_count = get_node_count();
+		for (size_t i = 0; i < node_count; i++) {
+			if (full_nodes[i].count >> quantized_node_pair::count_bits || full_nodes[i].first >> (32 - quantized_node_pair::count_bits)) return false;
+		}
+
+		std::vector<quantized_node_pair> pairs(node_count / 2);
+		std::vector<aabb> decoded_bounds(node_count);
+		decoded_bounds[0] = full_nodes[0].bounds;
+		for (size_t i = 0; i < node_count; i++) {
+			const bvh_node& node = full_nodes[i];
+			if (node.count > 0) continue;
+			quantized_node_pair& pair = pairs[node.first / 2];
+			for (size_t side = 0; side < 2; side++) {
+				pair.set_node(side, full_nodes[node.first + side], decoded_bounds[i]);
+				decoded_bounds[node.first + side] = pair.get_bounds(side, decoded_bounds[i]);
+			}
+		}
+
+		std::vector<bvh_node>{ full_nodes[0] }.swap(nodes);
+		quantized_nodes.swap(pairs);
+		attached_nodes = nullptr;
+		attached_node_count = 0;
+		return true;
+	}
+
+	inline bool bvh::is_quantized() const { return !quantized_nodes.empty(); }
+
+	inline bool bvh::is_empty() const { return get_node_count() == 0; }
+
+	inline aabb bvh::get_bounds() const { return is_empty() ? aabb{} : get_nodes()[0].bounds; }
+
+	inline const bvh_node* bvh::get_nodes() const { return attached_nodes ? attached_nodes : nodes.data(); }
+
+	inline const std::vector<quantized_node_pair>& bvh::get_quantized_nodes() const { return quantized_nodes; }
+
+	// Parents come before their children, so the nodes are decoded in a single pass
+	inline std::vector<bvh_node> bvh::decode_nodes() const
+	{
+		if (!is_quantized()) return std::vector<bvh_node>(get_nodes(), get_nodes() + get_node_count());
+		std::vector<bvh_node> decoded_nodes(get_node_count());
+		decoded_nodes[0] = nodes[0];
+		for (size_t i = 0; i < decoded_nodes.size(); i++) {
+			const bvh_node& node = decoded_nodes[i];
+			if (node.count > 0) continue;
+			const quantized_node_pair& pair = quantized_nodes[node.first / 2];
+			for (size_t side = 0; side < 2; side++) {
+				decoded_nodes[node.first + side] = { pair.get_bounds(side, node.bounds), pair.get_first(side), pair.get_count(side) };
+			}
+		}
+		return decoded_nodes;
+	}
+
+	inline size_t bvh::get_node_count() const { return attached_nodes ? attached_node_count : nodes.size() + 2 * quantized_nodes.size(); }
+
+	inline size_t bvh::get_memory_size() const
+	{
+		return (attached_nodes ? attached_node_count : nodes.size()) * sizeof(bvh_node) + quantized_nodes.size() * sizeof(quantized_node_pair);
+	}
+
+	inline const std::vector<uint32_t>& bvh::get_primitive_order() const { return primitive_order; }
+
+	inline std::array<float, 5> bvh::get_build_settings()
+	{
+		return { static_cast<float>(bin_count), static_cast<float>(max_leaf_size), static_cast<float>(max_depth), traversal_cost, intersection_cost };
+	}
+
+	template<typename F>
+	inline void bvh::traverse(float3 position, float3 direction, const float& max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const
+	{
+		if (is_empty()) return;
+		if (is_quantized()) return traverse_quantized(position, direction, max_t, min_t, stats, visit_leaf);
+		const bvh_node* nodes = get_nodes();
+		float3 inv_direction = 1 / direction;
+
+		std::pair<uint32_t, float> stack[max_depth + 4];
+		size_t stack_size = 0;
+		float root_t = nodes[0].bounds.intersect(position, inv_direction, max_t, min_t);
+		if (root_t <= max_t) stack[stack_size++] = { 0, root_t };
+
+		while (stack_size > 0) {
+			auto [node_id, node_t] = stack[--stack_size];
+			if (node_t > max_t) continue;
+
+			const bvh_node& node = nodes[node_id];
+			stats.add_node();
+			if (node.count > 0) {
+				stats.add_leaf();
+				visit_leaf(node.first, node.count);
+				continue;
+			}
+
+			float left_t = nodes[node.first].bounds.intersect(position, inv_direction, max_t, min_t);
+			float right_t = nodes[node.first + 1].bounds.intersect(position, inv_direction, max_t, min_t);
+			std::pair<uint32_t, float> near{ node.first, left_t }, far{ node.first + 1, right_t };
+			if (right_t < left_t) std::swap(near, far);
+			if (far.second <= max_t) stack[stack_size++] = far;
+			if (near.second <= max_t) stack[stack_size++] = near;
+		}
+	}
+
+	template<typename F>
+	inline bool bvh::traverse_any(float3 position, float3 direction, float max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const
+	{
+		if (is_empty()) return false;
+		if (is_quantized()) return traverse_any_quantized(position, direction, max_t, min_t, stats, visit_leaf);
+		const bvh_node* nodes = get_nodes();
+		float3 inv_direction = 1 / direction;
+
+		uint32_t stack[max_depth + 4];
+		size_t stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0) {
+			const bvh_node& node = nodes[stack[--stack_size]];
+			if (node.bounds.intersect(position, inv_direction, max_t, min_t) > max_t) continue;
+
+			stats.add_node();
+			if (node.count > 0) {
+				stats.add_leaf();
+				if (visit_leaf(node.first, node.count)) return true;
+				continue;
+			}
+
+			bool is_left_larger = nodes[node.first].bounds.get_area() >= nodes[node.first + 1].bounds.get_area();
+			stack[stack_size++] = is_left_larger ? node.first + 1 : node.first;
+			stack[stack_size++] = is_left_larger ? node.first : node.first + 1;
+		}
+
+		return false;
+	}
+
+	// The same traversals, the stack carrying the decoded box of every node to decode its children from
+	template<typename F>
+	inline void bvh::traverse_quantized(float3 position, float3 direction, const float& max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const
+	{
+		struct entry
+		{
+			aabb bounds;
+			uint32_t first;
+			uint32_t count;
+			float t;
+		};
+		float3 inv_direction = 1 / direction;
+
+		entry stack[max_depth + 4];
+		size_t stack_size = 0;
+		const bvh_node& root = nodes[0];
+		float root_t = root.bounds.intersect(position, inv_direction, max_t, min_t);
+		if (root_t <= max_t) stack[stack_size++] = { root.bounds, root.first, root.count, root_t };
+
+		while (stack_size > 0) {
+			entry node = stack[--stack_size];
+			if (node.t > max_t) continue;
+
+			stats.add_node();
+			if (node.count > 0) {
+				stats.add_leaf();
+				visit_leaf(node.first, node.count);
+				continue;
+			}
+
+			const quantized_node_pair& pair = quantized_nodes[node.first / 2];
+			aabb left_bounds, right_bounds;
+			pair.get_bounds(node.bounds, left_bounds, right_bounds);
+			entry near{ left_bounds, pair.get_first(0), pair.get_count(0), left_bounds.intersect(position, inv_direction, max_t, min_t) };
+			entry far{ right_bounds, pair.get_first(1), pair.get_count(1), right_bounds.intersect(position, inv_direction, max_t, min_t) };
+			if (far.t < near.t) std::swap(near, far);
+			if (far.t <= max_t) stack[stack_size++] = far;
+			if (near.t <= max_t) stack[stack_size++] = near;
+		}
+	}
+
+	template<typename F>
+	inline bool bvh::traverse_any_quantized(float3 position, float3 direction, float max_t, float min_t, traversal_stats& stats, F&& visit_leaf) const
+	{
+		struct entry
+		{
+			aabb bounds;
+			uint32_t first;
+			uint32_t count;
+		};
+		float3 inv_direction = 1 / direction;
+
+		entry stack[max_depth + 4];
+		size_t stack_size = 0;
+		stack[stack_size++] = { nodes[0].bounds, nodes[0].first, nodes[0].count };
+
+		while (stack_size > 0) {
+			entry node = stack[--stack_size];
+			if (node.bounds.intersect(position, inv_direction, max_t, min_t) > max_t) continue;
+
+			stats.add_node();
+			if (node.count > 0) {
+				stats.add_leaf();
+				if (visit_leaf(node.first, node.count)) return true;
+				continue;
+			}
+
+			const quantized_node_pair& pair = quantized_nodes[node.first / 2];
+			entry left{ aabb{}, pair.get_first(0), pair.get_count(0) };
+			entry right{ aabb{}, pair.get_first(1), pair.get_count(1) };
+			pair.get_bounds(node.bounds, left.bounds, right.bounds);
+			bool is_left_larger = left.bounds.get_area() >= right.bounds.get_area();
+			stack[stack_size++] = is_left_larger ? right : left;
+			stack[stack_size++] = is_left_larger ? left : right;
+		}
+
+		return false;
+	}
+} // namespace cg::renderer
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "utils/hash.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cg::renderer
+{
+	// Layout of a cached acceleration structure. The file holds no pointers, only offsets from its start,
+	// so that a mapped file is traced in place. The sections follow the header, each starting on a cache
+	// line: the meshes, the materials, the nodes of all the bottom-level hierarchies, the triangle packets,
+	// the cold triangles and the index in its mesh of the triangle in every slot. Quantized hierarchies are
+	// saved decoded, and quantize to the same pairs again once mapped. The key covers the model and
+	// everything the build depends on, a file with another key is rebuilt
+	struct bvh_cache_header
+	{
+		char magic[4] = { 'C', 'G', 'B', 'V' };
+		uint32_t version = 3;
+		uint64_t key = 0;
+		uint64_t mesh_count = 0;
+		uint64_t material_count = 0;
+		uint64_t node_count = 0;
+		uint64_t triangle_count = 0;
+		uint64_t mesh_offset = 0;
+		uint64_t material_offset = 0;
+		uint64_t node_offset = 0;
+		uint64_t packet_offset = 0;
+		uint64_t triangle_offset = 0;
+		uint64_t source_offset = 0;
+		uint64_t file_size = 0;
+	};
+
+	struct bvh_cache_mesh
+	{
+		uint64_t first_triangle;
+		uint64_t triangle_count;
+		uint64_t first_node;
+		uint64_t node_count;
+	};
+
+	constexpr size_t bvh_cache_alignment = 64;
+} // namespace cg::renderer
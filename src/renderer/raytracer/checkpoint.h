@@ -0,0 +1,150 @@
+#pragma once
+
+#include "renderer/raytracer/accumulator.h"
+#include "renderer/raytracer/denoiser.h"
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace cg::renderer
+{
+	// Everything needed to continue a render: the per-pixel accumulators in linear HDR, and the first-hit
+	// features if they were collected. The samplers are stateless functions of the pixel, the sample index
+	// and the seed, so the sample count of every pixel together with the seed in the header restores them.
+	// A checkpoint may cover only a crop of the frame and a range of sample indices, which is what lets
+	// several processes share a frame and `merge_checkpoint` put their parts together
+	struct checkpoint_header
+	{
+		char magic[4] = { 'C', 'G', 'R', 'C' };
+		uint32_t version = 2;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t sampler_type = 0;
+		uint32_t seed = 0;
+		uint32_t depth = 0;
+		uint32_t has_features = 0;
+		uint32_t crop_x = 0;
+		uint32_t crop_y = 0;
+		uint32_t crop_width = 0;
+		uint32_t crop_height = 0;
+		// Sample indices [sample_begin, sample_end) of the pixels, the end being that of the pixel
+		// with the most samples
+		uint32_t sample_begin = 0;
+		uint32_t sample_end = 0;
+	};
+
+	struct checkpoint
+	{
+		checkpoint_header header;
+		std::vector<accumulator> accumulators;
+		std::vector<features> feature_buffer;
+	};
+
+	// The file is written next to the target and renamed over it, so that a render killed while saving
+	// still leaves the previous checkpoint intact
+	inline void save_checkpoint(const checkpoint& checkpoint, const std::filesystem::path& filepath)
+	{
+		std::filesystem::path temporary_path = filepath;
+		temporary_path += ".tmp";
+		{
+			std::ofstream fs(temporary_path, std::ios::out | std::ios::binary);
+			if (!fs) THROW_ERROR("Can't open the checkpoint for writing: " + temporary_path.string());
+
+			fs.write(reinterpret_cast<const char*>(&checkpoint.header), sizeof(checkpoint_header));
+			fs.write(reinterpret_cast<const char*>(checkpoint.accumulators.data()), checkpoint.accumulators.size() * sizeof(accumulator));
+			if (checkpoint.header.has_features) {
+				fs.write(reinterpret_cast<const char*>(checkpoint.feature_buffer.data()), checkpoint.feature_buffer.size() * sizeof(features));
+			}
+			if (!fs) THROW_ERROR("Can't write the checkpoint: " + temporary_path.string());
+		}
+		std::filesystem::rename(temporary_path, filepath);
+	}
+
+	inline checkpoint load_checkpoint(const std::filesystem::path& filepath)
+	{
+		std::ifstream fs(filepath, std::ios::in | std::ios::binary);
+		if (!fs) THROW_ERROR("Can't open the checkpoint: " + filepath.string());
+
+		checkpoint checkpoint;
+		checkpoint_header expected;
+		fs.read(reinterpret_cast<char*>(&checkpoint.header), sizeof(checkpoint_header));
+		if (!fs || !std::equal(expected.magic, expected.magic + 4, checkpoint.header.magic))
+			THROW_ERROR("Not a checkpoint: " + filepath.string());
+		if (checkpoint.header.version != expected.version)
+			THROW_ERROR("Unsupported checkpoint version: " + std::to_string(checkpoint.header.version));
+
+		const checkpoint_header& header = checkpoint.header;
+		if (header.crop_x + header.crop_width > header.width || header.crop_y + header.crop_height > header.height)
+			THROW_ERROR("The crop of the checkpoint is outside of its frame: " + filepath.string());
+
+		size_t pixel_count = static_cast<size_t>(header.crop_width) * header.crop_height;
+		checkpoint.accumulators.resize(pixel_count);
+		fs.read(reinterpret_cast<char*>(checkpoint.accumulators.data()), pixel_count * sizeof(accumulator));
+		if (checkpoint.header.has_features) {
+			checkpoint.feature_buffer.resize(pixel_count);
+			fs.read(reinterpret_cast<char*>(checkpoint.feature_buffer.data()), pixel_count * sizeof(features));
+		}
+		if (!fs) THROW_ERROR("Truncated checkpoint: " + filepath.string());
+
+		return checkpoint;
+	}
+
+	inline bool is_overlapping(const checkpoint_header& a, const checkpoint_header& b)
+	{
+		bool crops_overlap = a.crop_x < b.crop_x + b.crop_width && b.crop_x < a.crop_x + a.crop_width &&
+							 a.crop_y < b.crop_y + b.crop_height && b.crop_y < a.crop_y + a.crop_height;
+		return crops_overlap && a.sample_begin < b.sample_end && b.sample_begin < a.sample_end;
+	}
+
+	// Adds a part rendered by another process to a full-frame checkpoint. An empty `merged` takes the
+	// frame and the first sample index of the first part. Parts must come from the same scene setup and
+	// be merged in the order of their sample ranges. Every pixel keeps the samples [sample_begin,
+	// sample_begin + count), which is where resuming continues from, so a part has to start each of its
+	// pixels right after the samples merged there so far: a gap would have resuming reuse sample indices,
+	// an overlap would count the same samples twice
+	inline void merge_checkpoint(checkpoint& merged, const checkpoint& part, std::vector<checkpoint_header>& merged_parts)
+	{
+		const checkpoint_header& header = part.header;
+		if (merged_parts.empty()) {
+			merged.header = header;
+			merged.header.crop_x = merged.header.crop_y = 0;
+			merged.header.crop_width = header.width;
+			merged.header.crop_height = header.height;
+			merged.header.sample_begin = header.sample_begin;
+			merged.header.sample_end = header.sample_end;
+			merged.accumulators.assign(static_cast<size_t>(header.width) * header.height, accumulator{});
+			merged.feature_buffer.assign(header.has_features ? merged.accumulators.size() : 0, features{});
+		}
+
+		if (header.width != merged.header.width || header.height != merged.header.height || header.sampler_type != merged.header.sampler_type ||
+			header.seed != merged.header.seed || header.depth != merged.header.depth || header.has_features != merged.header.has_features)
+			THROW_ERROR("The parts were rendered with different settings");
+		for (const checkpoint_header& other : merged_parts) {
+			if (is_overlapping(header, other)) THROW_ERROR("The parts share pixels and sample indices");
+		}
+		for (uint32_t y = 0; y < header.crop_height; y++) {
+			for (uint32_t x = 0; x < header.crop_width; x++) {
+				size_t part_pixel = x + static_cast<size_t>(y) * header.crop_width;
+				size_t pixel = (header.crop_x + x) + static_cast<size_t>(header.crop_y + y) * header.width;
+				if (part.accumulators[part_pixel].count > 0 && header.sample_begin != merged.header.sample_begin + merged.accumulators[pixel].count)
+					THROW_ERROR("The sample ranges of the parts leave a gap or overlap at some pixels");
+			}
+		}
+		merged_parts.push_back(header);
+		merged.header.sample_end = std::max(merged.header.sample_end, header.sample_end);
+
+		for (uint32_t y = 0; y < header.crop_height; y++) {
+			for (uint32_t x = 0; x < header.crop_width; x++) {
+				size_t part_pixel = x + static_cast<size_t>(y) * header.crop_width;
+				size_t pixel = (header.crop_x + x) + static_cast<size_t>(header.crop_y + y) * header.width;
+				uint32_t count = merged.accumulators[pixel].count;
+				if (header.has_features) merged.feature_buffer[pixel].merge(part.feature_buffer[part_pixel], count, part.accumulators[part_pixel].count);
+				merged.accumulators[pixel].merge(part.accumulators[part_pixel]);
+			}
+		}
+	}
+} // namespace cg::renderer
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "renderer/raytracer/accumulator.h"
+#include "resource.h"
+
+#include <algorithm>
+#include <cmath>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Surface attributes at the first hit of the camera rays, averaged over the samples of a pixel.
+	// Pixels that only see the background keep zeros
+	struct features
+	{
+		float3 emission{ 0.f };
+		float3 albedo{ 0.f };
+		float3 normal{ 0.f };
+		float depth = 0.f;
+
+		void add(const features& sample, uint32_t count);
+		void merge(const features& other, uint32_t count, uint32_t other_count);
+	};
+
+	inline void features::add(const features& sample, uint32_t count)
+	{
+		float weight = 1.f / static_cast<float>(count + 1);
+		emission += (sample.emission - emission) * weight;
+		albedo += (sample.albedo - albedo) * weight;
+		normal += (sample.normal - normal) * weight;
+		depth += (sample.depth - depth) * weight;
+	}
+
+	inline void features::merge(const features& other, uint32_t count, uint32_t other_count)
+	{
+		if (other_count == 0) return;
+		float weight = static_cast<float>(other_count) / static_cast<float>(count + other_count);
+		emission += (other.emission - emission) * weight;
+		albedo += (other.albedo - albedo) * weight;
+		normal += (other.normal - normal) * weight;
+		depth += (other.depth - depth) * weight;
+	}
+
+	// Edge-avoiding a-trous wavelet filter ("Edge-Avoiding A-Trous Wavelet Transform for fast Global
+	// Illumination Filtering", Dammertz et al. 2010), with the luminance edges scaled by the variance
+	// of every pixel as in SVGF (Schied et al. 2017). Light seen directly carries no noise besides
+	// antialiasing, so it's set aside, and the albedo is divided out of the rest before filtering and
+	// multiplied back after, so that neither gets blurred together with the noise
+	class denoiser
+	{
+	public:
+		denoiser(size_t width, size_t height);
+
+		void set_iterations(size_t in_iterations);
+		void denoise(cg::resource<accumulator>& history, cg::resource<features>& feature_buffer, std::vector<float3>& result) const;
+
+	protected:
+		size_t width;
+		size_t height;
+		size_t iterations = 5;
+
+		float sigma_luminance = 4.f;
+		// The normal weight is the cosine to the power 2^7 = 128, squared this many times rather than
+		// calling `pow` in the inner loop
+		static constexpr int sigma_normal_squarings = 7;
+		float sigma_depth = 1.f;
+
+		std::vector<float> estimate_variance(cg::resource<accumulator>& history, const std::vector<float3>& irradiance) const;
+	};
+
+	inline denoiser::denoiser(size_t width, size_t height) : width(width), height(height) {}
+
+	inline void denoiser::set_iterations(size_t in_iterations) { iterations = in_iterations; }
+
+	inline void denoiser::denoise(cg::resource<accumulator>& history, cg::resource<features>& feature_buffer, std::vector<float3>& result) const
+	{
+		constexpr float albedo_floor = 1e-3f;
+		constexpr float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+		int w = static_cast<int>(width);
+		int h = static_cast<int>(height);
+		size_t pixel_count = width * height;
+
+		std::vector<float3> albedo(pixel_count);
+		std::vector<float3> normal(pixel_count);
+		std::vector<float> depth(pixel_count);
+		std::vector<float2> depth_gradient(pixel_count);
+		std::vector<float3> irradiance(pixel_count);
+
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(pixel_count); i++) {
+			const features& pixel = feature_buffer.item(i);
+			float normal_length = length(pixel.normal);
+			albedo[i] = pixel.albedo;
+			normal[i] = normal_length > 0 ? pixel.normal / normal_length : float3{ 0.f };
+			depth[i] = pixel.depth;
+
+			// Channels without albedo are filtered as they are
+			float3 divisor = max(albedo[i], float3{ albedo_floor });
+			for (int c = 0; c < 3; c++) {
+				if (albedo[i][c] <= albedo_floor) divisor[c] = 1.f;
+			}
+			irradiance[i] = max(history.item(i).mean - pixel.emission, float3{ 0.f }) / divisor;
+			albedo[i] = divisor;
+		}
+
+		// Screen-space depth slopes, so that the depth edge test tolerates surfaces seen at grazing angles
+		#pragma omp parallel for
+		for (int y = 0; y < h; y++) {
+			for (int x = 0; x < w; x++) {
+				int left = std::max(x - 1, 0), right = std::min(x + 1, w - 1);
+				int top = std::max(y - 1, 0), bottom = std::min(y + 1, h - 1);
+				depth_gradient[x + y * w] = float2{
+					(depth[right + y * w] - depth[left + y * w]) / std::max(right - left, 1),
+					(depth[x + bottom * w] - depth[x + top * w]) / std::max(bottom - top, 1)
+				};
+			}
+		}
+
+		std::vector<float> variance = estimate_variance(history, irradiance);
+		std::vector<float3> filtered(pixel_count);
+		std::vector<float> filtered_variance(pixel_count);
+
+		for (size_t iteration = 0; iteration < iterations; iteration++) {
+			int step = 1 << iteration;
+
+			#pragma omp parallel for
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					int p = x + y * w;
+					float3 color = irradiance[p] * kernel[0] * kernel[0];
+					float color_variance = variance[p] * kernel[0] * kernel[0] * kernel[0] * kernel[0];
+					float total_weight = kernel[0] * kernel[0];
+
+					// Background pixels have no features to compare
+					if (depth[p] <= 0) {
+						filtered[p] = irradiance[p];
+						filtered_variance[p] = variance[p];
+						continue;
+					}
+
+					float luminance = get_luminance(irradiance[p]);
+					float luminance_scale = sigma_luminance * std::sqrt(std::max(variance[p], 0.f)) + 1e-6f;
+
+					for (int dy = -2; dy <= 2; dy++) {
+						int qy = y + dy * step;
+						if (qy < 0 || qy >= h) continue;
+						for (int dx = -2; dx <= 2; dx++) {
+							int qx = x + dx * step;
+							if ((dx == 0 && dy == 0) || qx < 0 || qx >= w) continue;
+							int q = qx + qy * w;
+							if (depth[q] <= 0) continue;
+
+							float normal_weight = std::max(dot(normal[p], normal[q]), 0.f);
+							for (int i = 0; i < sigma_normal_squarings; i++) normal_weight *= normal_weight;
+							float expected_depth = std::abs(dot(depth_gradient[p], float2{ static_cast<float>(dx * step), static_cast<float>(dy * step) }));
+							float depth_weight = std::exp(-std::abs(depth[p] - depth[q]) / (sigma_depth * expected_depth + 1e-3f * depth[p]));
+							float luminance_weight = std::exp(-std::abs(luminance - get_luminance(irradiance[q])) / luminance_scale);
+
+							float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] * normal_weight * depth_weight * luminance_weight;
+							color += irradiance[q] * weight;
+							color_variance += variance[q] * weight * weight;
+							total_weight += weight;
+						}
+					}
+
+					filtered[p] = color / total_weight;
+					filtered_variance[p] = color_variance / (total_weight * total_weight);
+				}
+			}
+
+			irradiance.swap(filtered);
+			variance.swap(filtered_variance);
+		}
+
+		result.resize(pixel_count);
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(pixel_count); i++) {
+			result[i] = irradiance[i] * albedo[i] + feature_buffer.item(i).emission;
+		}
+	}
+
+	// Variance of the mean luminance of every pixel, blurred over 3x3 pixels since a handful of samples
+	// make a poor estimate. Pixels with too few samples for their own estimate use the spread of their
+	// 7x7 neighbourhood instead
+	inline std::vector<float> denoiser::estimate_variance(cg::resource<accumulator>& history, const std::vector<float3>& irradiance) const
+	{
+		constexpr uint32_t min_samples = 4;
+		int w = static_cast<int>(width);
+		int h = static_cast<int>(height);
+		std::vector<float> variance(width * height);
+		std::vector<float> blurred(width * height);
+
+		#pragma omp parallel for
+		for (int y = 0; y < h; y++) {
+			for (int x = 0; x < w; x++) {
+				int p = x + y * w;
+				const accumulator& pixel = history.item(p);
+				float irradiance_scale = get_luminance(irradiance[p]) / std::max(pixel.get_luminance(), 1e-6f);
+				if (pixel.count >= min_samples) {
+					variance[p] = pixel.get_variance() / static_cast<float>(pixel.count) * irradiance_scale * irradiance_scale;
+					continue;
+				}
+
+				float sum = 0.f, sum_of_squares = 0.f;
+				int count = 0;
+				for (int qy = std::max(y - 3, 0); qy <= std::min(y + 3, h - 1); qy++) {
+					for (int qx = std::max(x - 3, 0); qx <= std::min(x + 3, w - 1); qx++) {
+						float luminance = get_luminance(irradiance[qx + qy * w]);
+						sum += luminance;
+						sum_of_squares += luminance * luminance;
+						count++;
+					}
+				}
+				float mean = sum / count;
+				variance[p] = std::max(sum_of_squares / count - mean * mean, 0.f) / static_cast<float>(std::max(pixel.count, 1u));
+			}
+		}
+
+		#pragma omp parallel for
+		for (int y = 0; y < h; y++) {
+			for (int x = 0; x < w; x++) {
+				float sum = 0.f, total_weight = 0.f;
+				for (int dy = -1; dy <= 1; dy++) {
+					for (int dx = -1; dx <= 1; dx++) {
+						int qx = x + dx, qy = y + dy;
+						if (qx < 0 || qx >= w || qy < 0 || qy >= h) continue;
+						float weight = (dx == 0 ? 2.f : 1.f) * (dy == 0 ? 2.f : 1.f);
+						sum += variance[qx + qy * w] * weight;
+						total_weight += weight;
+					}
+				}
+				blurred[x + y * w] = sum / total_weight;
+			}
+		}
+
+		return blurred;
+	}
+} // namespace cg::renderer
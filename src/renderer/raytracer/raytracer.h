@@ -1,12 +1,33 @@
 #pragma once
 
+#include "renderer/rasterizer/rasterizer.h"
+#include "renderer/raytracer/accumulator.h"
+#include "renderer/raytracer/bvh.h"
+#include "renderer/raytracer/bvh_cache.h"
+#include "renderer/raytracer/checkpoint.h"
+#include "renderer/raytracer/denoiser.h"
+#include "renderer/raytracer/sampler.h"
+#include "renderer/raytracer/triangle_packet.h"
 #include "resource.h"
+#include "utils/mapped_file.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <linalg.h>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <omp.h>
-#include <random>
+#include <thread>
 
 using namespace linalg::aliases;
 
@@ -14,6 +35,7 @@ namespace cg::renderer
 {
 	struct ray
 	{
+		ray() {}
 		ray(float3 position, float3 direction) : position(position)
 		{
 			this->direction = normalize(direction);
@@ -27,55 +49,139 @@ namespace cg::renderer
 		float t;
 		float3 bary;
 		cg::fcolor color;
+		size_t triangle_id;
+		size_t instance_id;
 	};
 
-	template<typename VB>
-	struct triangle
+	// State of a single light path between two bounces
+	struct path_state
 	{
-		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
+		float3 throughput;
+		size_t pixel;
+		cg::renderer::sampler sampler;
+		// Index of the current bounce, and the solid angle pdf of the direction that led to it
+		// (zero for camera rays)
+		size_t bounce;
+		float bsdf_pdf;
+	};
 
-		float3 a;
-		float3 b;
-		float3 c;
+	struct material
+	{
+		float3 ambient;
+		float3 diffuse;
+		float3 emissive;
+	};
+
+	// The part of a triangle read by every intersection test. Traversal reads it from the triangle
+	// packets, kept apart from the shading data so that only positions and edges are pulled into the cache
+	struct hot_triangle
+	{
+		// Degenerate, for the padding of packets
+		hot_triangle();
+		hot_triangle(float3 a, float3 b, float3 c);
 
+		float3 a;
 		float3 ba;
 		float3 ca;
+	};
+
+	inline hot_triangle::hot_triangle() : a(0.f), ba(0.f), ca(0.f) {}
+
+	inline hot_triangle::hot_triangle(float3 a, float3 b, float3 c) : a(a), ba(b - a), ca(c - a) {}
+
+	// The shading data of a triangle, fetched only for the closest hit
+	template<typename VB>
+	struct triangle
+	{
+		// Shading data of the padding of packets, never hit
+		triangle();
+		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c, unsigned int material_id);
 
 		float3 na;
 		float3 nb;
 		float3 nc;
 
-		float3 ambient;
-		float3 diffuse;
-		float3 emissive;
+		float2 uva;
+		float2 uvb;
+		float2 uvc;
+
+		unsigned int material_id;
 	};
 
 	template<typename VB>
-	inline triangle<VB>::triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c) : 
-		a(vertex_a.pos.xyz()), b(vertex_b.pos.xyz()), c(vertex_c.pos.xyz()), 
-		ba(vertex_b.pos.xyz() - vertex_a.pos.xyz()), ca(vertex_c.pos.xyz() - vertex_a.pos.xyz()),
-		na(vertex_a.norm), nb(vertex_b.norm), nc(vertex_c.norm), 
-		ambient(vertex_a.ambient), diffuse(vertex_a.diffuse), emissive(vertex_a.emissive) {}
+	inline triangle<VB>::triangle() : triangle(VB{}, VB{}, VB{}, 0) {}
 
 	template<typename VB>
-	class aabb
+	inline triangle<VB>::triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c, unsigned int material_id) :
+		na(vertex_a.norm), nb(vertex_b.norm), nc(vertex_c.norm),
+		uva(vertex_a.uv), uvb(vertex_b.uv), uvc(vertex_c.uv), material_id(material_id) {}
+
+	// A triangle mesh in object space, made of one pair of vertex and index buffers. Its triangles are
+	// the range [first_triangle, first_triangle + triangle_count) of the triangle arrays, in the order
+	// of the leaves of its bottom-level hierarchy. Every leaf starts on a packet, the rest of its last
+	// packet being degenerate padding, so that a leaf of up to `packet_width` triangles is one packet test
+	struct mesh
 	{
-	public:
-		void add_triangle(const triangle<VB> triangle);
-		const std::vector<triangle<VB>>& get_triangles() const;
-		bool aabb_test(const ray& ray) const;
+		size_t first_triangle = 0;
+		size_t triangle_count = 0;
+		bvh blas;
+		// Index of every triangle in the index buffer in leaf order, or `bvh::padding`. Spatial splits
+		// may put a triangle in several leaves
+		std::vector<uint32_t> source_triangles;
+		bool is_changed = false;
+	};
 
-	protected:
-		std::vector<triangle<VB>> triangles;
+	// A placement of a mesh in the scene. Rays are moved into the object space of the mesh, instead of
+	// the mesh being copied into world space for every placement
+	struct instance
+	{
+		instance(size_t mesh_id, const float4x4& transform);
+
+		size_t mesh_id;
+		float4x4 transform;
+		float4x4 inverse_transform;
+		// Inverse transpose of the linear part, for normals
+		float3x3 normal_transform;
+
+		float3 to_world_point(float3 point) const;
+		// Not normalized
+		float3 to_world_normal(float3 normal) const;
+		// Keeps the direction unnormalized, so that distances along the ray stay the same in both spaces
+		ray to_object_space(const ray& ray) const;
+	};
+
+	inline instance::instance(size_t mesh_id, const float4x4& transform) :
+		mesh_id(mesh_id), transform(transform), inverse_transform(inverse(transform))
+	{
+		float3x3 inverse_linear{ inverse_transform[0].xyz(), inverse_transform[1].xyz(), inverse_transform[2].xyz() };
+		normal_transform = linalg::transpose(inverse_linear);
+	}
+
+	inline float3 instance::to_world_point(float3 point) const { return mul(transform, float4{ point, 1.f }).xyz(); }
 
-		float3 aabb_min;
-		float3 aabb_max;
+	inline float3 instance::to_world_normal(float3 normal) const { return mul(normal_transform, normal); }
+
+	inline ray instance::to_object_space(const ray& world_ray) const
+	{
+		ray object_ray;
+		object_ray.position = mul(inverse_transform, float4{ world_ray.position, 1.f }).xyz();
+		object_ray.direction = mul(inverse_transform, float4{ world_ray.direction, 0.f }).xyz();
+		return object_ray;
+	}
+
+	// A corner of a triangle, rasterized for the visibility of camera rays
+	struct visibility_vertex
+	{
+		float4 pos;
 	};
 
+	// An emissive triangle, sampled explicitly for direct lighting
 	struct light
 	{
-		float3 position;
-		float3 color;
+		// In world space
+		hot_triangle geometry;
+		float area;
+		float3 emissive;
 	};
 
 	template<typename VB, typename RT>
@@ -91,29 +197,194 @@ namespace cg::renderer
 
 		void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
 		void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+		// Places the mesh made of the vertex and index buffers number `mesh_id` in the scene. Without any
+		// instances, every mesh is placed once as it is
+		void add_instance(size_t mesh_id, const float4x4& transform);
+		// Builds a bottom-level hierarchy for every mesh in object space. Does nothing if the meshes were
+		// loaded from a cache
+		void build_meshes();
+		// Builds the top-level hierarchy over the instances, and the meshes first if they aren't built yet
 		void build_acceleration_structure();
-		std::vector<aabb<VB>> acceleration_structures;
+		// Moves an instance, and marks a mesh whose vertex buffer has changed with the same index buffer.
+		// Both take effect with `update_acceleration_structure`
+		void set_instance_transform(size_t instance_id, const float4x4& transform);
+		void update_mesh(size_t mesh_id);
+		// Refits the hierarchies of the changed meshes and the top-level one, bottom-up. A hierarchy that
+		// refitting has made `rebuild_threshold` times more expensive to trace than it was when built is
+		// rebuilt instead, as the boxes of moving primitives grow to overlap
+		void update_acceleration_structure();
+		void set_rebuild_threshold(float in_rebuild_threshold);
+		// Builder of the hierarchies, the linear one also building the top level. Spatial splits may grow
+		// the triangle references to `memory_budget` times the triangles of a mesh
+		void set_bvh_builder(bvh_builder in_builder, float in_memory_budget);
+		// Keeps the nodes of every hierarchy as quantized pairs once built, see `bvh::quantize`
+		void set_bvh_quantization(bool in_is_bvh_quantized);
+		// Maps the meshes built by an earlier run and traces them straight from the file. Returns false,
+		// leaving the meshes to be built, if there is no file or it was built from another model or with
+		// other settings. `model_hash` identifies the contents of the vertex and index buffers
+		bool load_acceleration_structure(const std::filesystem::path& path, uint64_t model_hash);
+		void save_acceleration_structure(const std::filesystem::path& path, uint64_t model_hash) const;
+
+		void set_sampler(sampler_type in_sampler_type, unsigned int in_seed);
+		void set_tile_size(size_t in_tile_size);
+		// Restricts tracing to the rectangle (x, y, width, height) of the viewport, and shifts the sample
+		// indices by `in_sample_offset`, so that several processes can share the pixels or the samples of
+		// a frame and merge their checkpoints later
+		void set_crop(uint4 in_crop);
+		void set_sample_offset(unsigned int in_sample_offset);
+		// Stops sampling a pixel once the 95% confidence interval of its displayed value is narrower
+		// than `in_threshold`, and the whole render once the average of that error over the image
+		// drops below `in_error_target` or `in_time_budget` seconds pass. Zero disables a rule
+		void set_adaptive_sampling(float in_threshold, float in_error_target, float in_time_budget);
+		// Saves the accumulated samples to `in_path` every `in_interval` seconds of tracing and at the end
+		// of it. A zero interval only saves at the end
+		void set_checkpoint(const std::filesystem::path& in_path, float in_interval);
+		// Continues accumulation from a checkpoint of the same viewport, sampler, seed and depth
+		void resume(const std::filesystem::path& in_path, size_t depth);
+		// Linear HDR version of the render target
+		std::shared_ptr<cg::resource<cg::fcolor>> get_hdr_target() const;
+		// Takes the first hit of every camera ray from a visibility buffer, rasterized once per call of the
+		// ray generation, and only traces the bounces. Camera rays then go through the pixel centres, as
+		// the rasterizer samples them, so the edges of the first hits aren't antialiased
+		void set_hybrid(bool in_is_hybrid);
 
 		void ray_generation(float3 position, float3 direction, float3 right, float3 up, float fov, size_t depth, size_t accumulation_num);
+		void wavefront_ray_generation(float3 position, float3 direction, float3 right, float3 up, float fov, size_t depth, size_t accumulation_num);
 
-		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
-		payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
+		payload trace_ray(const ray& ray, size_t depth, path_state& path, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Iterative path integrator over `scatter_shader`: follows a path for up to `depth` segments
+		// carrying its throughput, and returns the radiance it gathered
+		float3 trace_path(ray ray, size_t depth, path_state& path, float max_t = 1000.f, float min_t = 0.001f) const;
+		// The same path, whose first hit was found by other means, `first_hit` being null for a miss
+		float3 trace_path(ray ray, const payload* first_hit, size_t depth, path_state& path, float max_t = 1000.f, float min_t = 0.001f) const;
+		bool find_closest_hit(const ray& ray, payload& closest_intersection, float max_t = 1000.f, float min_t = 0.001f) const;
+		payload intersection_shader(const hot_triangle& triangle, const ray& ray) const;
+		// Any-hit query for shadow and visibility rays: stops at the first triangle within
+		// [min_t, max_t] and never builds a payload or calls a shader
+		bool trace_occlusion(const ray& ray, float max_t = 1000.f, float min_t = 0.001f) const;
 
 		std::function<payload(const ray& ray)> miss_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
+		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth, path_state& path)>
 				closest_hit_shader = nullptr;
+		// Shades a hit without tracing further: writes the radiance emitted at the hit into `payload.color`,
+		// and either returns false to terminate the path, or returns true with the continuation ray in
+		// `next_ray` and the path state advanced to the next bounce
+		std::function<bool(const ray& ray, payload& payload, const triangle<VB>& triangle, path_state& path, cg::renderer::ray& next_ray)>
+				scatter_shader = nullptr;
+		// Surface attributes at the first hit of a camera ray. When set, they're averaged per pixel into
+		// the feature buffer that guides `denoise`
+		std::function<features(const ray& ray, const payload& payload, const triangle<VB>& triangle)> feature_shader = nullptr;
+
+		// Replaces the render target with a filtered version of the accumulated image
+		void denoise();
 
-		float2 get_jitter(int frame_id);
+		size_t get_triangle_count() const;
+		size_t get_mesh_count() const;
+		const mesh& get_mesh(size_t mesh_id) const;
+		size_t get_instance_count() const;
+		const instance& get_instance(size_t instance_id) const;
+		// In the object space of its mesh
+		hot_triangle get_hot_triangle(size_t triangle_id) const;
+		const triangle<VB>& get_triangle(size_t triangle_id) const;
+		const material& get_material(unsigned int material_id) const;
 
 	protected:
 		std::shared_ptr<cg::resource<RT>> render_target;
-		std::shared_ptr<cg::resource<float3>> history;
+		std::shared_ptr<cg::resource<accumulator>> history;
+		std::shared_ptr<cg::resource<features>> feature_buffer;
+		std::shared_ptr<cg::resource<cg::fcolor>> hdr_target;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
+		// Triangle `i` is the lane `i % packet_width` of the packet `i / packet_width`
+		std::vector<triangle_packet> triangle_packets;
 		std::vector<triangle<VB>> triangles;
+		// The triangles traced, either in the vectors above or in the mapped cache file
+		const triangle_packet* packet_data = nullptr;
+		const triangle<VB>* triangle_data = nullptr;
+		size_t triangle_count = 0;
+		// Triangles in the ranges left behind by meshes that outgrew them
+		size_t unused_triangles = 0;
+		std::shared_ptr<cg::utils::mapped_file> cache_file;
+		std::vector<material> materials;
+		std::vector<mesh> meshes;
+		std::vector<instance> instances;
+		bvh tlas;
+		// Instance at every position of the leaf ranges of the top-level hierarchy
+		std::vector<uint32_t> instance_order;
+		float rebuild_threshold = 1.5f;
+		bvh_builder builder = bvh_builder::sah;
+		float memory_budget = 1.3f;
+		bool is_bvh_quantized = false;
+		bool is_hybrid = false;
+		std::shared_ptr<cg::resource<visibility>> visibility_buffer;
+		std::shared_ptr<cg::resource<float>> visibility_depth;
+
+		// Traversal work per thread, kept on separate cache lines
+		struct alignas(64) thread_traversal_stats
+		{
+			uint64_t closest_rays = 0;
+			traversal_stats closest;
+			uint64_t occlusion_rays = 0;
+			traversal_stats occlusion;
+			// Camera rays of the hybrid mode that missed the triangle of the visibility buffer
+			uint64_t visibility_rays = 0;
+			uint64_t visibility_fallbacks = 0;
+		};
+		mutable std::vector<thread_traversal_stats> thread_stats;
 
 		size_t width = 1920;
 		size_t height = 1080;
+
+		sampler_type sampling_type = sampler_type::sobol;
+		unsigned int seed = 0;
+		size_t tile_size = 16;
+		uint4 crop{ 0, 0, 1920, 1080 };
+		unsigned int sample_offset = 0;
+		float adaptive_threshold = 0.f;
+		float error_target = 0.f;
+		float time_budget = 0.f;
+		std::filesystem::path checkpoint_path;
+		float checkpoint_interval = 0.f;
+
+		struct queued_ray
+		{
+			cg::renderer::ray ray;
+			path_state path;
+		};
+
+		struct queued_hit
+		{
+			cg::renderer::payload payload;
+			bool is_hit;
+			size_t ray_id;
+		};
+
+		void sort_ray_queue(std::vector<queued_ray>& queue) const;
+		std::vector<uint2> get_tile_order() const;
+		uint4 get_tile_bounds(uint2 tile) const;
+		bool is_in_crop(size_t x, size_t y) const;
+		size_t get_crop_pixel_count() const;
+		bool is_converged(const accumulator& pixel, size_t accumulation_num) const;
+		bool russian_roulette(path_state& path) const;
+		void record_features(const path_state& path, const ray& ray, const payload* hit) const;
+		void resolve_history();
+		void rasterize_visibility(float3 position, float3 direction, float3 right, float3 up, float fov);
+		bool find_primary_hit(const ray& ray, size_t pixel, payload& hit, float max_t = 1000.f, float min_t = 0.001f) const;
+		void add_traversal_stats(const traversal_stats& stats, bool is_occlusion) const;
+		void print_traversal_stats() const;
+		checkpoint make_checkpoint(size_t depth, const std::vector<uint2>* tiles = nullptr, std::vector<std::atomic<bool>>* tile_busy = nullptr) const;
+		uint64_t get_cache_key(uint64_t model_hash) const;
+		void read_mesh(size_t mesh_id, std::vector<hot_triangle>& mesh_hot_triangles, std::vector<triangle<VB>>& mesh_triangles) const;
+		void set_hot_triangle(size_t triangle_id, const hot_triangle& triangle);
+		static std::vector<aabb> get_triangle_bounds(const std::vector<hot_triangle>& mesh_hot_triangles);
+		static void split_triangle(const hot_triangle& triangle, const aabb& bounds, int axis, float position, aabb& left, aabb& right);
+		void build_blas(mesh& mesh, const std::vector<hot_triangle>& mesh_hot_triangles) const;
+		std::vector<aabb> get_triangle_bounds(const mesh& mesh) const;
+		aabb get_instance_bounds(const instance& instance) const;
+		void place_mesh(mesh& mesh, const std::vector<hot_triangle>& mesh_hot_triangles, const std::vector<triangle<VB>>& mesh_triangles);
+		void compact_meshes();
+		void build_tlas();
+		void quantize_hierarchies();
 	};
 
 	template<typename VB, typename RT>
@@ -125,14 +396,18 @@ namespace cg::renderer
 	inline void raytracer<VB, RT>::set_viewport(size_t in_width, size_t in_height) {
 		width = in_width;
 		height = in_height;
-		history = std::make_shared<cg::resource<float3>>(width, height);
+		history = std::make_shared<cg::resource<accumulator>>(width, height);
+		feature_buffer = std::make_shared<cg::resource<features>>(width, height);
+		hdr_target = std::make_shared<cg::resource<cg::fcolor>>(width, height);
+		crop = uint4{ 0, 0, static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
 	}
 
 	template<typename VB, typename RT>
 	inline void raytracer<VB, RT>::clear_render_target(const RT& in_clear_value) {
 		for (size_t i = 0; i < render_target->get_number_of_elements(); i++) {
 			render_target->item(i) = in_clear_value;
-			history->item(i) = float3{ 0.f };
+			history->item(i) = accumulator{};
+			feature_buffer->item(i) = features{};
 		}
 	}
 
@@ -147,19 +422,584 @@ namespace cg::renderer
 	}
 
 	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::build_acceleration_structure()
+	inline void raytracer<VB, RT>::add_instance(size_t mesh_id, const float4x4& transform) {
+		if (mesh_id >= std::max(index_buffers.size(), meshes.size())) THROW_ERROR("No mesh " + std::to_string(mesh_id) + " to instance");
+		instances.emplace_back(mesh_id, transform);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_sampler(sampler_type in_sampler_type, unsigned int in_seed) {
+		sampling_type = in_sampler_type;
+		seed = in_seed;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_tile_size(size_t in_tile_size) {
+		tile_size = in_tile_size;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_adaptive_sampling(float in_threshold, float in_error_target, float in_time_budget) {
+		adaptive_threshold = in_threshold;
+		error_target = in_error_target;
+		time_budget = in_time_budget;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_crop(uint4 in_crop) {
+		if (in_crop.z == 0 || in_crop.w == 0 || in_crop.x + in_crop.z > width || in_crop.y + in_crop.w > height)
+			THROW_ERROR("The crop must be a non-empty rectangle inside of the viewport");
+		crop = in_crop;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_sample_offset(unsigned int in_sample_offset) {
+		sample_offset = in_sample_offset;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_checkpoint(const std::filesystem::path& in_path, float in_interval) {
+		checkpoint_path = in_path;
+		checkpoint_interval = in_interval;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::resume(const std::filesystem::path& in_path, size_t depth)
 	{
+		checkpoint checkpoint = load_checkpoint(in_path);
+		const checkpoint_header& header = checkpoint.header;
+		if (header.width != width || header.height != height)
+			THROW_ERROR("The checkpoint is " + std::to_string(header.width) + "x" + std::to_string(header.height) + ", not " +
+						std::to_string(width) + "x" + std::to_string(height));
+		if (header.sampler_type != static_cast<uint32_t>(sampling_type) || header.seed != seed)
+			THROW_ERROR("The checkpoint was rendered with another sampler or seed");
+		if (header.depth != depth)
+			THROW_ERROR("The checkpoint was rendered with depth " + std::to_string(header.depth));
+		if (feature_shader && !header.has_features)
+			THROW_ERROR("The checkpoint has no feature buffers to denoise with");
+		if (uint4{ header.crop_x, header.crop_y, header.crop_width, header.crop_height } != crop || header.sample_begin != sample_offset)
+			THROW_ERROR("The checkpoint covers another crop or sample range");
+
+		size_t sample_count = 0;
+		for (size_t y = 0; y < crop.w; y++) {
+			for (size_t x = 0; x < crop.z; x++) {
+				size_t i = x + y * crop.z;
+				history->item(crop.x + x, crop.y + y) = checkpoint.accumulators[i];
+				if (header.has_features) feature_buffer->item(crop.x + x, crop.y + y) = checkpoint.feature_buffer[i];
+				sample_count += checkpoint.accumulators[i].count;
+			}
+		}
+		std::cout << "Resumed " << static_cast<float>(sample_count) / get_crop_pixel_count() << " samples per pixel from " << in_path.string() << "\n";
+	}
+
+	template<typename VB, typename RT>
+	inline std::shared_ptr<cg::resource<cg::fcolor>> raytracer<VB, RT>::get_hdr_target() const { return hdr_target; }
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_hybrid(bool in_is_hybrid) {
+		is_hybrid = in_is_hybrid;
+	}
+
+	// Copies the accumulated state. While threads are tracing, every tile is copied under its busy flag,
+	// so that no pixel is caught halfway through an update, and the other tiles keep being traced
+	template<typename VB, typename RT>
+	inline checkpoint raytracer<VB, RT>::make_checkpoint(
+			size_t depth, const std::vector<uint2>* tiles, std::vector<std::atomic<bool>>* tile_busy) const
+	{
+		checkpoint checkpoint;
+		checkpoint.header.width = static_cast<uint32_t>(width);
+		checkpoint.header.height = static_cast<uint32_t>(height);
+		checkpoint.header.sampler_type = static_cast<uint32_t>(sampling_type);
+		checkpoint.header.seed = seed;
+		checkpoint.header.depth = static_cast<uint32_t>(depth);
+		checkpoint.header.has_features = feature_shader != nullptr;
+		checkpoint.header.crop_x = crop.x;
+		checkpoint.header.crop_y = crop.y;
+		checkpoint.header.crop_width = crop.z;
+		checkpoint.header.crop_height = crop.w;
+		checkpoint.accumulators.resize(get_crop_pixel_count());
+		if (feature_shader) checkpoint.feature_buffer.resize(get_crop_pixel_count());
+
+		uint32_t max_count = 0;
+		auto copy_rect = [&](uint4 bounds) {
+			for (size_t y = bounds.y; y < bounds.w; y++) {
+				for (size_t x = bounds.x; x < bounds.z; x++) {
+					size_t i = (x - crop.x) + (y - crop.y) * crop.z;
+					checkpoint.accumulators[i] = history->item(x, y);
+					if (feature_shader) checkpoint.feature_buffer[i] = feature_buffer->item(x, y);
+					max_count = std::max(max_count, checkpoint.accumulators[i].count);
+				}
+			}
+		};
+
+		if (!tiles) {
+			copy_rect(uint4{ crop.x, crop.y, crop.x + crop.z, crop.y + crop.w });
+		} else {
+			for (size_t tile_id = 0; tile_id < tiles->size(); tile_id++) {
+				while ((*tile_busy)[tile_id].exchange(true)) std::this_thread::yield();
+				copy_rect(get_tile_bounds((*tiles)[tile_id]));
+				(*tile_busy)[tile_id] = false;
+			}
+		}
+
+		checkpoint.header.sample_begin = sample_offset;
+		checkpoint.header.sample_end = sample_offset + max_count;
+		return checkpoint;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::build_meshes()
+	{
+		if (cache_file) return;
+
+		std::map<std::array<float, 9>, unsigned int> material_ids;
+		// The triangles of every mesh in the order of its index buffer
+		std::vector<std::vector<hot_triangle>> mesh_hot_triangles(index_buffers.size());
+		std::vector<std::vector<triangle<VB>>> mesh_triangles(index_buffers.size());
+		triangle_packets.clear();
+		triangles.clear();
+		unused_triangles = 0;
+		materials.clear();
+		meshes.clear();
+
 		for (size_t i = 0; i < index_buffers.size(); i++) {
-			aabb<VB> aabb;
-			for (size_t vi = 0; vi < index_buffers[i]->get_number_of_elements();) {
-				aabb.add_triangle({
-					vertex_buffers[i]->item(index_buffers[i]->item(vi++)), 
-					vertex_buffers[i]->item(index_buffers[i]->item(vi++)), 
-					vertex_buffers[i]->item(index_buffers[i]->item(vi++))
-				});
+			meshes.emplace_back();
+			for (size_t vi = 0; vi < index_buffers[i]->get_number_of_elements(); vi += 3) {
+				const VB& vertex_a = vertex_buffers[i]->item(index_buffers[i]->item(vi));
+				const VB& vertex_b = vertex_buffers[i]->item(index_buffers[i]->item(vi + 1));
+				const VB& vertex_c = vertex_buffers[i]->item(index_buffers[i]->item(vi + 2));
+
+				// Triangles only keep an index into the shared table of unique materials
+				material material { vertex_a.ambient, vertex_a.diffuse, vertex_a.emissive };
+				std::array<float, 9> material_key {
+					material.ambient.x, material.ambient.y, material.ambient.z,
+					material.diffuse.x, material.diffuse.y, material.diffuse.z,
+					material.emissive.x, material.emissive.y, material.emissive.z
+				};
+				auto material_id = material_ids.find(material_key);
+				if (material_id == material_ids.end()) {
+					material_id = material_ids.insert({ material_key, static_cast<unsigned int>(materials.size()) }).first;
+					materials.push_back(material);
+				}
+
+				mesh_hot_triangles[i].emplace_back(vertex_a.pos.xyz(), vertex_b.pos.xyz(), vertex_c.pos.xyz());
+				mesh_triangles[i].emplace_back(vertex_a, vertex_b, vertex_c, material_id->second);
+			}
+		}
+
+		// The meshes are independent, and each of them ends up with its triangles in leaf order. The linear
+		// builder rather spreads every large mesh over the threads itself, so those are built one by one
+		// and only the small ones side by side
+		std::vector<size_t> small_meshes;
+		for (size_t i = 0; i < meshes.size(); i++) {
+			if (builder == bvh_builder::lbvh && mesh_hot_triangles[i].size() >= bvh::min_parallel_primitives) build_blas(meshes[i], mesh_hot_triangles[i]);
+			else small_meshes.push_back(i);
+		}
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < static_cast<int>(small_meshes.size()); i++) {
+			build_blas(meshes[small_meshes[i]], mesh_hot_triangles[small_meshes[i]]);
+		}
+		for (size_t i = 0; i < meshes.size(); i++) place_mesh(meshes[i], mesh_hot_triangles[i], mesh_triangles[i]);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::build_acceleration_structure()
+	{
+		if (meshes.empty()) build_meshes();
+		if (instances.empty()) {
+			for (size_t i = 0; i < meshes.size(); i++) instances.emplace_back(i, linalg::identity);
+		}
+
+		build_tlas();
+		quantize_hierarchies();
+
+		size_t instanced_triangles = 0;
+		for (const instance& instance : instances) instanced_triangles += meshes[instance.mesh_id].triangle_count;
+		size_t blas_nodes = 0, blas_size = 0;
+		for (const mesh& mesh : meshes) {
+			blas_nodes += mesh.blas.get_node_count();
+			blas_size += mesh.blas.get_memory_size();
+		}
+		std::cout << "Acceleration structure: " << triangle_count / packet_width << " packets of " << packet_width << " triangles in " << meshes.size() << " meshes, "
+				  << instances.size() << " instances of " << instanced_triangles << " triangle slots, " << materials.size() << " materials, "
+				  << blas_nodes << " + " << tlas.get_node_count() << " nodes in " << blas_size / 1024 << " + " << tlas.get_memory_size() / 1024
+				  << (is_bvh_quantized ? " KiB quantized, " : " KiB, ")
+				  << sizeof(triangle_packet) / packet_width << " hot + " << sizeof(triangle<VB>) << " cold bytes per triangle\n";
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_instance_transform(size_t instance_id, const float4x4& transform) {
+		instances[instance_id] = instance(instances[instance_id].mesh_id, transform);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::update_mesh(size_t mesh_id) {
+		if (cache_file) THROW_ERROR("Meshes mapped from a cache can't be updated");
+		meshes[mesh_id].is_changed = true;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_rebuild_threshold(float in_rebuild_threshold) {
+		rebuild_threshold = in_rebuild_threshold;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_bvh_builder(bvh_builder in_builder, float in_memory_budget) {
+		builder = in_builder;
+		memory_budget = in_memory_budget;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_bvh_quantization(bool in_is_bvh_quantized) {
+		is_bvh_quantized = in_is_bvh_quantized;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::update_acceleration_structure()
+	{
+		size_t refitted = 0, rebuilt = 0;
+		for (size_t i = 0; i < meshes.size(); i++) {
+			mesh& mesh = meshes[i];
+			if (!mesh.is_changed) continue;
+			mesh.is_changed = false;
+
+			std::vector<hot_triangle> mesh_hot_triangles;
+			std::vector<triangle<VB>> mesh_triangles;
+			read_mesh(i, mesh_hot_triangles, mesh_triangles);
+			place_mesh(mesh, mesh_hot_triangles, mesh_triangles);
+			mesh.blas.refit(get_triangle_bounds(mesh));
+			if (mesh.blas.get_sah_cost() <= rebuild_threshold * mesh.blas.get_built_sah_cost()) {
+				refitted++;
+				continue;
+			}
+			build_blas(mesh, mesh_hot_triangles);
+			place_mesh(mesh, mesh_hot_triangles, mesh_triangles);
+			rebuilt++;
+		}
+		if (2 * unused_triangles > triangle_count) compact_meshes();
+
+		std::vector<aabb> instance_bounds(instance_order.size());
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(instance_order.size()); i++) {
+			instance_bounds[i] = get_instance_bounds(instances[instance_order[i]]);
+		}
+		tlas.refit(instance_bounds);
+		bool is_tlas_rebuilt = tlas.get_sah_cost() > rebuild_threshold * tlas.get_built_sah_cost();
+		if (is_tlas_rebuilt) build_tlas();
+		quantize_hierarchies();
+
+		std::cout << "Acceleration structure update: " << refitted << " meshes refitted, " << rebuilt << " rebuilt, instances "
+				  << (is_tlas_rebuilt ? "rebuilt" : "refitted") << "\n";
+	}
+
+	// Reads the triangles of a built mesh from its buffers again, in the order of the buffers. Only the
+	// materials are taken from the placed triangles
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::read_mesh(size_t mesh_id, std::vector<hot_triangle>& mesh_hot_triangles, std::vector<triangle<VB>>& mesh_triangles) const
+	{
+		const mesh& mesh = meshes[mesh_id];
+		const auto& vertex_buffer = vertex_buffers[mesh_id];
+		const auto& index_buffer = index_buffers[mesh_id];
+		mesh_hot_triangles.assign(index_buffer->get_number_of_elements() / 3, hot_triangle{});
+		mesh_triangles.assign(mesh_hot_triangles.size(), triangle<VB>{});
+		for (size_t t = 0; t < mesh.triangle_count; t++) {
+			uint32_t source = mesh.source_triangles[t];
+			if (source != bvh::padding) mesh_triangles[source].material_id = triangles[mesh.first_triangle + t].material_id;
+		}
+
+		#pragma omp parallel for
+		for (int source = 0; source < static_cast<int>(mesh_triangles.size()); source++) {
+			size_t vi = static_cast<size_t>(source) * 3;
+			const VB& vertex_a = vertex_buffer->item(index_buffer->item(vi));
+			const VB& vertex_b = vertex_buffer->item(index_buffer->item(vi + 1));
+			const VB& vertex_c = vertex_buffer->item(index_buffer->item(vi + 2));
+
+			mesh_hot_triangles[source] = hot_triangle(vertex_a.pos.xyz(), vertex_b.pos.xyz(), vertex_c.pos.xyz());
+			mesh_triangles[source] = triangle<VB>(vertex_a, vertex_b, vertex_c, mesh_triangles[source].material_id);
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline std::vector<aabb> raytracer<VB, RT>::get_triangle_bounds(const std::vector<hot_triangle>& mesh_hot_triangles)
+	{
+		std::vector<aabb> triangle_bounds(mesh_hot_triangles.size());
+		for (size_t t = 0; t < mesh_hot_triangles.size(); t++) {
+			const hot_triangle& triangle = mesh_hot_triangles[t];
+			triangle_bounds[t].add_point(triangle.a);
+			triangle_bounds[t].add_point(triangle.a + triangle.ba);
+			triangle_bounds[t].add_point(triangle.a + triangle.ca);
+		}
+		return triangle_bounds;
+	}
+
+	// Clips the triangle by the plane, and each side by `bounds`
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::split_triangle(const hot_triangle& triangle, const aabb& bounds, int axis, float position, aabb& left, aabb& right)
+	{
+		float3 vertices[3] = { triangle.a, triangle.a + triangle.ba, triangle.a + triangle.ca };
+		for (int i = 0; i < 3; i++) {
+			float3 from = vertices[i];
+			float3 to = vertices[(i + 1) % 3];
+			if (from[axis] <= position) left.add_point(from);
+			if (from[axis] >= position) right.add_point(from);
+			if ((from[axis] < position && to[axis] > position) || (from[axis] > position && to[axis] < position)) {
+				float3 crossing = from + (to - from) * ((position - from[axis]) / (to[axis] - from[axis]));
+				crossing[axis] = position;
+				left.add_point(crossing);
+				right.add_point(crossing);
+			}
+		}
+		left.clip(bounds);
+		right.clip(bounds);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::build_blas(mesh& mesh, const std::vector<hot_triangle>& mesh_hot_triangles) const
+	{
+		std::vector<aabb> triangle_bounds = get_triangle_bounds(mesh_hot_triangles);
+		if (builder == bvh_builder::sbvh) {
+			auto split_primitive = [&](uint32_t primitive, const aabb& bounds, int axis, float position, aabb& left, aabb& right) {
+				split_triangle(mesh_hot_triangles[primitive], bounds, axis, position, left, right);
+			};
+			mesh.blas.build_spatial(triangle_bounds, split_primitive, memory_budget, packet_width);
+		} else if (builder == bvh_builder::lbvh) {
+			mesh.blas.build_linear(triangle_bounds, packet_width);
+		} else {
+			mesh.blas.build(triangle_bounds, packet_width);
+		}
+	}
+
+	// In leaf order, the padding left empty
+	template<typename VB, typename RT>
+	inline std::vector<aabb> raytracer<VB, RT>::get_triangle_bounds(const mesh& mesh) const
+	{
+		std::vector<aabb> triangle_bounds(mesh.triangle_count);
+		for (size_t t = 0; t < mesh.triangle_count; t++) {
+			if (mesh.source_triangles[t] == bvh::padding) continue;
+			hot_triangle triangle = get_hot_triangle(mesh.first_triangle + t);
+			triangle_bounds[t].add_point(triangle.a);
+			triangle_bounds[t].add_point(triangle.a + triangle.ba);
+			triangle_bounds[t].add_point(triangle.a + triangle.ca);
+		}
+		return triangle_bounds;
+	}
+
+	// World bounds of an instance, from the corners of its bottom-level box
+	template<typename VB, typename RT>
+	inline aabb raytracer<VB, RT>::get_instance_bounds(const instance& instance) const
+	{
+		aabb object_bounds = meshes[instance.mesh_id].blas.get_bounds();
+		aabb bounds;
+		if (object_bounds.is_empty()) return bounds;
+		for (int corner = 0; corner < 8; corner++) {
+			float3 point = select(bool3{ (corner & 1) != 0, (corner & 2) != 0, (corner & 4) != 0 }, object_bounds.get_max(), object_bounds.get_min());
+			bounds.add_point(instance.to_world_point(point));
+		}
+		return bounds;
+	}
+
+	// Writes the triangles of a mesh, given in the order of its buffers, into its range in the order of
+	// the leaves of its hierarchy, every leaf starting on a packet. A mesh that outgrew its range moves to
+	// the end of the triangle arrays, and its old range is left unused until `compact_meshes`
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::place_mesh(mesh& mesh, const std::vector<hot_triangle>& mesh_hot_triangles, const std::vector<triangle<VB>>& mesh_triangles)
+	{
+		const std::vector<uint32_t>& order = mesh.blas.get_primitive_order();
+		if (order.size() > mesh.triangle_count) {
+			unused_triangles += mesh.triangle_count;
+			mesh.first_triangle = triangles.size();
+			mesh.triangle_count = order.size();
+			triangles.resize(mesh.first_triangle + mesh.triangle_count);
+			triangle_packets.resize(triangles.size() / packet_width);
+			packet_data = triangle_packets.data();
+			triangle_data = triangles.data();
+			triangle_count = triangles.size();
+		}
+
+		mesh.source_triangles.resize(mesh.triangle_count);
+		#pragma omp parallel for
+		for (int t = 0; t < static_cast<int>(mesh.triangle_count); t++) {
+			uint32_t source = static_cast<size_t>(t) < order.size() ? order[t] : bvh::padding;
+			mesh.source_triangles[t] = source;
+			set_hot_triangle(mesh.first_triangle + t, source == bvh::padding ? hot_triangle{} : mesh_hot_triangles[source]);
+			triangles[mesh.first_triangle + t] = source == bvh::padding ? triangle<VB>{} : mesh_triangles[source];
+		}
+	}
+
+	// Moves the ranges of the meshes down over the unused ones, keeping their order. Ranges start on
+	// packets, so whole packets are moved along with the triangles
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::compact_meshes()
+	{
+		std::vector<size_t> mesh_order(meshes.size());
+		std::iota(mesh_order.begin(), mesh_order.end(), 0);
+		std::sort(mesh_order.begin(), mesh_order.end(), [&](size_t a, size_t b) { return meshes[a].first_triangle < meshes[b].first_triangle; });
+
+		size_t next_triangle = 0;
+		for (size_t mesh_id : mesh_order) {
+			mesh& mesh = meshes[mesh_id];
+			if (mesh.first_triangle != next_triangle) {
+				auto first = triangles.begin() + mesh.first_triangle;
+				std::copy(first, first + mesh.triangle_count, triangles.begin() + next_triangle);
+				auto first_packet = triangle_packets.begin() + mesh.first_triangle / packet_width;
+				std::copy(first_packet, first_packet + mesh.triangle_count / packet_width, triangle_packets.begin() + next_triangle / packet_width);
+				mesh.first_triangle = next_triangle;
+			}
+			next_triangle += mesh.triangle_count;
+		}
+
+		triangles.resize(next_triangle);
+		triangle_packets.resize(next_triangle / packet_width);
+		packet_data = triangle_packets.data();
+		triangle_data = triangles.data();
+		triangle_count = triangles.size();
+		unused_triangles = 0;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::build_tlas()
+	{
+		std::vector<aabb> instance_bounds(instances.size());
+		for (size_t i = 0; i < instances.size(); i++) instance_bounds[i] = get_instance_bounds(instances[i]);
+		if (builder == bvh_builder::lbvh) tlas.build_linear(instance_bounds);
+		else tlas.build(instance_bounds);
+		instance_order = tlas.get_primitive_order();
+	}
+
+	// Refitted hierarchies stay quantized, the rebuilt ones and those mapped from a cache are quantized here
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::quantize_hierarchies()
+	{
+		if (!is_bvh_quantized) return;
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < static_cast<int>(meshes.size()); i++) meshes[i].blas.quantize();
+		tlas.quantize();
+	}
+
+	// The key mixes the model with the layouts of the cached arrays and the parameters of the builder
+	template<typename VB, typename RT>
+	inline uint64_t raytracer<VB, RT>::get_cache_key(uint64_t model_hash) const
+	{
+		std::array<uint64_t, 6> layout{ bvh_cache_header{}.version, sizeof(VB), sizeof(triangle_packet), sizeof(triangle<VB>), sizeof(material), sizeof(bvh_node) };
+		std::array<float, 5> build_settings = bvh::get_build_settings();
+		std::array<float, 3> builder_settings{ static_cast<float>(builder), builder == bvh_builder::sbvh ? memory_budget : 0.f, is_bvh_quantized ? 1.f : 0.f };
+		uint64_t key = cg::utils::hash_bytes(&model_hash, sizeof(model_hash));
+		key = cg::utils::hash_bytes(layout.data(), sizeof(layout), key);
+		key = cg::utils::hash_bytes(builder_settings.data(), sizeof(builder_settings), key);
+		return cg::utils::hash_bytes(build_settings.data(), sizeof(build_settings), key);
+	}
+
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::load_acceleration_structure(const std::filesystem::path& path, uint64_t model_hash)
+	{
+		if (!std::filesystem::exists(path)) return false;
+
+		auto file = std::make_shared<cg::utils::mapped_file>(path);
+		if (file->get_size() < sizeof(bvh_cache_header)) return false;
+		const char* data = file->get_data();
+		const bvh_cache_header& header = *reinterpret_cast<const bvh_cache_header*>(data);
+		bvh_cache_header expected;
+		if (!std::equal(expected.magic, expected.magic + 4, header.magic) || header.version != expected.version ||
+			header.key != get_cache_key(model_hash) || header.file_size != file->get_size()) {
+			std::cout << "The cached acceleration structure is out of date: " << path.string() << "\n";
+			return false;
+		}
+
+		auto fits = [&](uint64_t offset, uint64_t count, size_t size) { return offset + count * size <= header.file_size; };
+		uint64_t packet_count = (header.triangle_count + packet_width - 1) / packet_width;
+		if (!fits(header.mesh_offset, header.mesh_count, sizeof(bvh_cache_mesh)) || !fits(header.material_offset, header.material_count, sizeof(material)) ||
+			!fits(header.node_offset, header.node_count, sizeof(bvh_node)) || !fits(header.packet_offset, packet_count, sizeof(triangle_packet)) ||
+			!fits(header.triangle_offset, header.triangle_count, sizeof(triangle<VB>)) || !fits(header.source_offset, header.triangle_count, sizeof(uint32_t)))
+			THROW_ERROR("Corrupted acceleration structure cache: " + path.string());
+
+		const bvh_cache_mesh* cached_meshes = reinterpret_cast<const bvh_cache_mesh*>(data + header.mesh_offset);
+		const material* cached_materials = reinterpret_cast<const material*>(data + header.material_offset);
+		const bvh_node* cached_nodes = reinterpret_cast<const bvh_node*>(data + header.node_offset);
+		const uint32_t* cached_sources = reinterpret_cast<const uint32_t*>(data + header.source_offset);
+
+		triangle_packets.clear();
+		triangles.clear();
+		unused_triangles = 0;
+		materials.assign(cached_materials, cached_materials + header.material_count);
+		meshes.clear();
+		for (uint64_t i = 0; i < header.mesh_count; i++) {
+			const bvh_cache_mesh& cached = cached_meshes[i];
+			if (cached.first_triangle + cached.triangle_count > header.triangle_count || cached.first_node + cached.node_count > header.node_count)
+				THROW_ERROR("Corrupted acceleration structure cache: " + path.string());
+			mesh& mesh = meshes.emplace_back();
+			mesh.first_triangle = static_cast<size_t>(cached.first_triangle);
+			mesh.triangle_count = static_cast<size_t>(cached.triangle_count);
+			mesh.blas.attach(cached_nodes + cached.first_node, static_cast<size_t>(cached.node_count), packet_width);
+			mesh.source_triangles.assign(cached_sources + cached.first_triangle, cached_sources + cached.first_triangle + cached.triangle_count);
+		}
+
+		packet_data = reinterpret_cast<const triangle_packet*>(data + header.packet_offset);
+		triangle_data = reinterpret_cast<const triangle<VB>*>(data + header.triangle_offset);
+		triangle_count = static_cast<size_t>(header.triangle_count);
+		cache_file = file;
+		std::cout << "Mapped the acceleration structure from " << path.string() << "\n";
+		return true;
+	}
+
+	// Written next to the target and renamed over it, so that a run killed while saving, or several runs
+	// saving at once, never leave a half-written file to be mapped
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::save_acceleration_structure(const std::filesystem::path& path, uint64_t model_hash) const
+	{
+		auto align = [](uint64_t offset) { return (offset + bvh_cache_alignment - 1) / bvh_cache_alignment * bvh_cache_alignment; };
+
+		std::vector<bvh_cache_mesh> cached_meshes;
+		uint64_t node_count = 0;
+		for (const mesh& mesh : meshes) {
+			cached_meshes.push_back({ mesh.first_triangle, mesh.triangle_count, node_count, mesh.blas.get_node_count() });
+			node_count += mesh.blas.get_node_count();
+		}
+
+		bvh_cache_header header;
+		header.key = get_cache_key(model_hash);
+		header.mesh_count = meshes.size();
+		header.material_count = materials.size();
+		header.node_count = node_count;
+		header.triangle_count = triangle_count;
+		header.mesh_offset = align(sizeof(bvh_cache_header));
+		header.material_offset = align(header.mesh_offset + header.mesh_count * sizeof(bvh_cache_mesh));
+		header.node_offset = align(header.material_offset + header.material_count * sizeof(material));
+		header.packet_offset = align(header.node_offset + header.node_count * sizeof(bvh_node));
+		header.triangle_offset = align(header.packet_offset + triangle_packets.size() * sizeof(triangle_packet));
+		header.source_offset = align(header.triangle_offset + header.triangle_count * sizeof(triangle<VB>));
+		header.file_size = header.source_offset + header.triangle_count * sizeof(uint32_t);
+
+		std::vector<uint32_t> sources(triangle_count, bvh::padding);
+		for (const mesh& mesh : meshes) std::copy(mesh.source_triangles.begin(), mesh.source_triangles.end(), sources.begin() + mesh.first_triangle);
+
+		std::filesystem::path temporary_path = path;
+		temporary_path += ".tmp";
+		{
+			std::ofstream fs(temporary_path, std::ios::out | std::ios::binary);
+			if (!fs) THROW_ERROR("Can't open the acceleration structure cache for writing: " + temporary_path.string());
+
+			uint64_t position = 0;
+			auto write_section = [&](uint64_t offset, const void* section, uint64_t size) {
+				static const char padding[bvh_cache_alignment] = {};
+				fs.write(padding, offset - position);
+				fs.write(static_cast<const char*>(section), size);
+				position = offset + size;
+			};
+			write_section(0, &header, sizeof(header));
+			write_section(header.mesh_offset, cached_meshes.data(), header.mesh_count * sizeof(bvh_cache_mesh));
+			write_section(header.material_offset, materials.data(), header.material_count * sizeof(material));
+			uint64_t node_offset = header.node_offset;
+			for (const mesh& mesh : meshes) {
+				write_section(node_offset, mesh.blas.decode_nodes().data(), mesh.blas.get_node_count() * sizeof(bvh_node));
+				node_offset += mesh.blas.get_node_count() * sizeof(bvh_node);
 			}
-			acceleration_structures.push_back(aabb);
+			write_section(header.packet_offset, packet_data, (header.triangle_count + packet_width - 1) / packet_width * sizeof(triangle_packet));
+			write_section(header.triangle_offset, triangle_data, header.triangle_count * sizeof(triangle<VB>));
+			write_section(header.source_offset, sources.data(), header.triangle_count * sizeof(uint32_t));
+			if (!fs) THROW_ERROR("Can't write the acceleration structure cache: " + temporary_path.string());
 		}
+		std::filesystem::rename(temporary_path, path);
+		std::cout << "Saved the acceleration structure to " << path.string() << "\n";
 	}
 
 	template<typename VB, typename RT>
@@ -169,64 +1009,723 @@ namespace cg::renderer
 	{
 		float max_v = 2 * tan(fov / 2);
 		float max_u = max_v * static_cast<float>(width) / static_cast<float>(height);
-		float iter_factor = 1.0f / accumulation_num;
+		// Without a stopping rule or periodic checkpoints every tile takes all of its samples in a single visit
+		constexpr size_t samples_per_visit = 8;
+		bool is_adaptive = adaptive_threshold > 0 || error_target > 0 || time_budget > 0;
+		bool is_checkpointing = !checkpoint_path.empty() && checkpoint_interval > 0;
+		size_t visit_samples = is_adaptive || is_checkpointing ? std::min(samples_per_visit, accumulation_num) : accumulation_num;
+
+		std::vector<uint2> tiles = get_tile_order();
+		thread_stats.assign(omp_get_max_threads(), thread_traversal_stats{});
+		if (is_hybrid) rasterize_visibility(position, direction, right, up, fov);
+		std::cout << "Tracing up to " << accumulation_num << " samples per pixel in " << tiles.size() << " tiles of "
+				  << tile_size << "x" << tile_size << "\n";
+
+		std::vector<std::atomic<bool>> tile_busy(tiles.size());
+		std::vector<std::atomic<float>> tile_error(tiles.size());
+		for (size_t i = 0; i < tiles.size(); i++) {
+			tile_busy[i] = false;
+			tile_error[i] = static_cast<float>(tile_size * tile_size);
+		}
+		// The tiles that still take samples, in curve order. A thread pops one, visits it, and puts it back
+		// at the end unless it converged, so that no tile is ever visited twice at once
+		std::deque<size_t> tile_queue(tiles.size());
+		std::iota(tile_queue.begin(), tile_queue.end(), size_t{ 0 });
+		std::mutex queue_mutex;
+		size_t visits = 0;
+		size_t round_visits = 0;
+		size_t round_size = tiles.size();
+		std::atomic<size_t> active_tiles{ tiles.size() };
+		std::atomic<size_t> sample_count{ 0 };
+		std::atomic<bool> stop{ false };
+		std::atomic<bool> is_saving{ false };
+		auto start_time = std::chrono::steady_clock::now();
+		auto last_checkpoint_time = start_time;
+
+		// Threads keep visiting the tiles round after round in curve order, and every visit adds a batch
+		// of samples to the pixels of the tile that haven't converged yet. There is no barrier between
+		// rounds, a round ends once as many visits as there were tiles at its start are done. The first
+		// round always completes, so that no tile is left empty when the budget runs out
+		#pragma omp parallel
+		{
+			while (active_tiles > 0) {
+				size_t tile_id = tiles.size();
+				{
+					std::lock_guard<std::mutex> lock(queue_mutex);
+					if (stop && visits >= tiles.size()) break;
+					if (!tile_queue.empty()) {
+						tile_id = tile_queue.front();
+						tile_queue.pop_front();
+						visits++;
+					}
+				}
+				// the remaining tiles are all being visited by other threads
+				if (tile_id == tiles.size()) {
+					std::this_thread::yield();
+					continue;
+				}
+				// only a checkpoint being saved may hold the tile
+				while (tile_busy[tile_id].exchange(true)) std::this_thread::yield();
+
+				uint4 bounds = get_tile_bounds(tiles[tile_id]);
+				size_t traced = 0;
+				float error = 0.f;
+				bool is_tile_done = true;
+
+				for (size_t y = bounds.y; y < bounds.w; y++) {
+					for (size_t x = bounds.x; x < bounds.z; x++) {
+						accumulator& pixel = history->item(x, y);
+						// The samples of a pixel share the first hit found in the visibility buffer
+						payload primary_hit {};
+						bool is_primary_found = false, is_primary_hit = false;
+						for (size_t i = 0; i < visit_samples && !is_converged(pixel, accumulation_num); i++, traced++) {
+							sampler sampler(sampling_type, static_cast<unsigned int>(x), static_cast<unsigned int>(y), sample_offset + pixel.count, seed);
+							float2 jitter = sampler.get_2d() - 0.5f;
+							if (is_hybrid) jitter = float2{ 0.f };
+							float u = max_u * ((x + jitter.x) / static_cast<float>(width) - 0.5f);
+							float v = max_v * ((y + jitter.y) / static_cast<float>(height) - 0.5f);
+
+							float3 primary_direction = direction + right * u - up * v;
+							ray primary_ray(position, primary_direction);
+							path_state path { float3{ 1.f }, x + y * width, sampler, 0, 0.f };
+							if (!is_hybrid) {
+								pixel.add(trace_path(primary_ray, depth, path));
+								continue;
+							}
+
+							if (!is_primary_found) {
+								is_primary_hit = find_primary_hit(primary_ray, path.pixel, primary_hit);
+								is_primary_found = true;
+							}
+							pixel.add(trace_path(primary_ray, is_primary_hit ? &primary_hit : nullptr, depth, path));
+						}
+
+						is_tile_done = is_tile_done && is_converged(pixel, accumulation_num);
+						error += std::min(pixel.get_error(), 1.f);
+					}
+				}
+
+				sample_count += traced;
+				tile_error[tile_id] = error;
+				tile_busy[tile_id] = false;
+
+				if (time_budget > 0) {
+					std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start_time;
+					if (elapsed.count() >= time_budget) stop = true;
+				}
+				{
+					std::lock_guard<std::mutex> lock(queue_mutex);
+					if (is_tile_done) {
+						active_tiles--;
+					} else {
+						tile_queue.push_back(tile_id);
+					}
+					// The global error is the average error over the pixels, checked once per round
+					if (++round_visits >= round_size) {
+						round_visits = 0;
+						round_size = active_tiles;
+						if (error_target > 0) {
+							float total_error = 0.f;
+							for (const auto& tile : tile_error) total_error += tile;
+							if (total_error / static_cast<float>(get_crop_pixel_count()) <= error_target) stop = true;
+						}
+					}
+				}
+				// One thread saves the checkpoint while the others go on tracing
+				if (is_checkpointing && !is_saving.exchange(true)) {
+					std::chrono::duration<float> since_checkpoint = std::chrono::steady_clock::now() - last_checkpoint_time;
+					if (since_checkpoint.count() >= checkpoint_interval) {
+						save_checkpoint(make_checkpoint(depth, &tiles, &tile_busy), checkpoint_path);
+						last_checkpoint_time = std::chrono::steady_clock::now();
+					}
+					is_saving = false;
+				}
+			}
+		}
+
+		if (is_adaptive) {
+			size_t converged = 0;
+			float total_error = 0.f;
+			for (size_t y = crop.y; y < crop.y + crop.w; y++) {
+				for (size_t x = crop.x; x < crop.x + crop.z; x++) {
+					converged += adaptive_threshold > 0 && is_converged(history->item(x, y), accumulation_num);
+					total_error += std::min(history->item(x, y).get_error(), 1.f);
+				}
+			}
+			float pixel_count = static_cast<float>(get_crop_pixel_count());
+			std::cout << "Adaptive sampling: " << sample_count / pixel_count << " samples per pixel on average, "
+					  << 100.f * converged / pixel_count << "% of pixels converged, average error "
+					  << total_error / pixel_count << "\n";
+		}
+
+		if (!checkpoint_path.empty()) save_checkpoint(make_checkpoint(depth), checkpoint_path);
+		print_traversal_stats();
+		resolve_history();
+	}
+
+	// A pixel is finished once it has the maximum number of samples, or once the confidence interval
+	// of its mean is narrow enough
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::is_converged(const accumulator& pixel, size_t accumulation_num) const
+	{
+		constexpr uint32_t min_samples = 8;
+		if (pixel.count >= accumulation_num) return true;
+		return adaptive_threshold > 0 && pixel.count >= min_samples && pixel.get_error() <= adaptive_threshold;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::wavefront_ray_generation(
+			float3 position, float3 direction,
+			float3 right, float3 up, float fov, size_t depth, size_t accumulation_num)
+	{
+		float max_v = 2 * tan(fov / 2);
+		float max_u = max_v * static_cast<float>(width) / static_cast<float>(height);
+		int pixel_count = static_cast<int>(width * height);
+
+		std::vector<queued_ray> queue;
+		std::vector<queued_ray> next_queue;
+		std::vector<queued_hit> hits;
+		std::vector<std::pair<size_t, size_t>> shading_order;
+		std::vector<char> alive;
+		std::vector<float3> radiance(pixel_count);
+		std::vector<int> pending;
+		auto last_checkpoint_time = std::chrono::steady_clock::now();
+		thread_stats.assign(omp_get_max_threads(), thread_traversal_stats{});
+		if (is_hybrid) rasterize_visibility(position, direction, right, up, fov);
 
+		// Every frame takes one more sample in the pixels below the limit, which after a resume may differ
 		for (size_t frame_id = 0; frame_id < accumulation_num; frame_id++) {
+			pending.clear();
+			for (int i = 0; i < pixel_count; i++) {
+				if (is_in_crop(i % width, i / width) && history->item(i).count < accumulation_num) pending.push_back(i);
+			}
+			if (pending.empty()) break;
 			std::cout << "Tracing " << frame_id + 1 << "/" << accumulation_num << " frame\n";
-			float2 jitter = get_jitter(frame_id);
 
+			queue.resize(pending.size());
 			#pragma omp parallel for
-			for (int x = 0; x < static_cast<int>(width); x++) {
-				for (int y = 0; y < static_cast<int>(height); y++) {
-					float u = max_u * ((x + jitter.x) / static_cast<float>(width) - 0.5f);
-					float v = max_v * ((y + jitter.y) / static_cast<float>(height) - 0.5f);
+			for (int j = 0; j < static_cast<int>(pending.size()); j++) {
+				int i = pending[j];
+				int x = i % static_cast<int>(width);
+				int y = i / static_cast<int>(width);
+				sampler sampler(sampling_type, x, y, sample_offset + history->item(i).count, seed);
+				float2 jitter = sampler.get_2d() - 0.5f;
+				if (is_hybrid) jitter = float2{ 0.f };
+				float u = max_u * ((x + jitter.x) / static_cast<float>(width) - 0.5f);
+				float v = max_v * ((y + jitter.y) / static_cast<float>(height) - 0.5f);
 
-					float3 primary_direction = direction + right * u - up * v;
-					ray primary_ray(position, primary_direction);
-					payload payload = trace_ray(primary_ray, depth);
+				queue[j] = { ray(position, direction + right * u - up * v), path_state{ float3{ 1.f }, static_cast<size_t>(i), sampler, 0, 0.f } };
+				radiance[i] = float3{ 0.f };
+			}
+
+			for (size_t bounce = 0; bounce < depth && !queue.empty(); bounce++) {
+				sort_ray_queue(queue);
+
+				hits.resize(queue.size());
+				#pragma omp parallel for
+				for (int i = 0; i < static_cast<int>(queue.size()); i++) {
+					hits[i].ray_id = i;
+					hits[i].payload = payload{};
+					hits[i].is_hit = is_hybrid && bounce == 0 ?
+							find_primary_hit(queue[i].ray, queue[i].path.pixel, hits[i].payload) :
+							find_closest_hit(queue[i].ray, hits[i].payload);
+				}
+
+				// Misses are resolved right away, hits are shaded in batches of the same material
+				shading_order.clear();
+				for (size_t i = 0; i < hits.size(); i++) {
+					if (hits[i].is_hit) {
+						shading_order.push_back({ triangle_data[hits[i].payload.triangle_id].material_id, i });
+						continue;
+					}
+
+					const queued_ray& missed = queue[hits[i].ray_id];
+					record_features(missed.path, missed.ray, nullptr);
+					radiance[missed.path.pixel] += missed.path.throughput * miss_shader(missed.ray).color;
+				}
+				std::sort(shading_order.begin(), shading_order.end());
 
-					history->item(x, y) += sqrt(payload.color * iter_factor);
+				next_queue.resize(shading_order.size());
+				alive.assign(shading_order.size(), 0);
+				#pragma omp parallel for
+				for (int i = 0; i < static_cast<int>(shading_order.size()); i++) {
+					queued_hit& hit = hits[shading_order[i].second];
+					queued_ray& incoming = queue[hit.ray_id];
+					float3 throughput = incoming.path.throughput;
+					record_features(incoming.path, incoming.ray, &hit.payload);
+
+					next_queue[i].path = incoming.path;
+					alive[i] = scatter_shader(incoming.ray, hit.payload, triangle_data[hit.payload.triangle_id], next_queue[i].path, next_queue[i].ray) &&
+							   russian_roulette(next_queue[i].path);
+					radiance[incoming.path.pixel] += throughput * hit.payload.color;
+				}
+
+				queue.clear();
+				for (size_t i = 0; i < next_queue.size(); i++) {
+					if (alive[i]) queue.push_back(next_queue[i]);
 				}
 			}
+
+			// Paths that ran out of depth are terminated the same way `trace_path` does it
+			for (const queued_ray& last : queue) {
+				radiance[last.path.pixel] += last.path.throughput * miss_shader(last.ray).color;
+			}
+
+			#pragma omp parallel for
+			for (int j = 0; j < static_cast<int>(pending.size()); j++) {
+				history->item(pending[j]).add(radiance[pending[j]]);
+			}
+
+			if (!checkpoint_path.empty() && checkpoint_interval > 0) {
+				std::chrono::duration<float> since_checkpoint = std::chrono::steady_clock::now() - last_checkpoint_time;
+				if (since_checkpoint.count() >= checkpoint_interval) {
+					save_checkpoint(make_checkpoint(depth), checkpoint_path);
+					last_checkpoint_time = std::chrono::steady_clock::now();
+				}
+			}
+		}
+
+		if (!checkpoint_path.empty()) save_checkpoint(make_checkpoint(depth), checkpoint_path);
+		print_traversal_stats();
+		resolve_history();
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::add_traversal_stats(const traversal_stats& stats, bool is_occlusion) const
+	{
+		if constexpr (!traversal_stats::is_counted) return;
+		size_t thread = static_cast<size_t>(omp_get_thread_num());
+		if (thread >= thread_stats.size()) return;
+		thread_traversal_stats& totals = thread_stats[thread];
+		(is_occlusion ? totals.occlusion_rays : totals.closest_rays)++;
+		traversal_stats& total = is_occlusion ? totals.occlusion : totals.closest;
+		total.nodes += stats.nodes;
+		total.leaves += stats.leaves;
+	}
+
+	// Nodes entered per ray, over both levels of the hierarchy, in builds that count them
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::print_traversal_stats() const
+	{
+		if constexpr (!traversal_stats::is_counted) return;
+		thread_traversal_stats sum;
+		for (const thread_traversal_stats& totals : thread_stats) {
+			sum.closest_rays += totals.closest_rays;
+			sum.closest.nodes += totals.closest.nodes;
+			sum.closest.leaves += totals.closest.leaves;
+			sum.occlusion_rays += totals.occlusion_rays;
+			sum.occlusion.nodes += totals.occlusion.nodes;
+			sum.occlusion.leaves += totals.occlusion.leaves;
+			sum.visibility_rays += totals.visibility_rays;
+			sum.visibility_fallbacks += totals.visibility_fallbacks;
+		}
+		auto per_ray = [](uint64_t count, uint64_t rays) { return rays > 0 ? static_cast<float>(count) / rays : 0.f; };
+		std::cout << "Traversal: " << per_ray(sum.closest.nodes, sum.closest_rays) << " nodes and " << per_ray(sum.closest.leaves, sum.closest_rays)
+				  << " leaves per closest-hit ray, " << per_ray(sum.occlusion.nodes, sum.occlusion_rays) << " nodes and "
+				  << per_ray(sum.occlusion.leaves, sum.occlusion_rays) << " leaves per occlusion ray\n";
+		if (is_hybrid) {
+			std::cout << "Visibility buffer: " << sum.visibility_rays << " first hits, " << 100.f * per_ray(sum.visibility_fallbacks, sum.visibility_rays)
+					  << "% traced again at the edges of triangles\n";
+		}
+	}
+
+	// Draws every instance into the visibility buffer with the projection of the camera rays: a world
+	// point at `s * (direction + right * u - up * v)` from the camera lands on the pixel of (u, v), and
+	// its depth is reversed, falling from 1 to 0 as `s` grows between planes that enclose the top-level
+	// bounds. The triangles are drawn from the hot ones in leaf order, so that the buffer names the
+	// triangle of the mesh directly, and meshes mapped from a cache are drawn as well. Only the crop is
+	// drawn, in a band of its rows per thread, each band by its own rasterizer
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::rasterize_visibility(float3 position, float3 direction, float3 right, float3 up, float fov)
+	{
+		auto start_time = std::chrono::steady_clock::now();
+		float max_v = 2 * tan(fov / 2);
+		float max_u = max_v * static_cast<float>(width) / static_cast<float>(height);
+
+		float3x3 basis{ right, -up, direction };
+		float3x3 inverse_basis = inverse(basis);
+		float4x4 view{
+			float4{ inverse_basis[0], 0.f }, float4{ inverse_basis[1], 0.f }, float4{ inverse_basis[2], 0.f },
+			float4{ -mul(inverse_basis, position), 1.f }
+		};
+
+		// The nearest and farthest `s` of the corners of the bounds, with a margin for rounding. When the
+		// camera is inside of the bounds, the near plane is a small fraction of the far one, which the
+		// reversed depth still resolves
+		aabb bounds = tlas.get_bounds();
+		float z_near = std::numeric_limits<float>::max();
+		float z_far = -std::numeric_limits<float>::max();
+		for (int corner = 0; corner < 8; corner++) {
+			float3 point{ corner & 1 ? bounds.get_max().x : bounds.get_min().x, corner & 2 ? bounds.get_max().y : bounds.get_min().y,
+						  corner & 4 ? bounds.get_max().z : bounds.get_min().z };
+			float s = mul(inverse_basis, point - position).z;
+			z_near = std::min(z_near, s);
+			z_far = std::max(z_far, s);
+		}
+		z_far *= 1.01f;
+		z_near = std::max(0.99f * z_near, 1e-6f * z_far);
+		float4x4 projection{
+			float4{ 2 / max_u, 0.f, 0.f, 0.f }, float4{ 0.f, -2 / max_v, 0.f, 0.f },
+			float4{ 0.f, 0.f, -z_near / (z_far - z_near), 1.f }, float4{ 0.f, 0.f, z_near * z_far / (z_far - z_near), 0.f }
+		};
+		float4x4 view_projection = mul(projection, view);
+
+		if (!visibility_buffer || visibility_buffer->get_number_of_elements() != width * height) {
+			visibility_buffer = std::make_shared<cg::resource<visibility>>(width, height);
+			visibility_depth = std::make_shared<cg::resource<float>>(width, height);
+		}
+
+		size_t max_triangle_count = 0;
+		for (const mesh& mesh : meshes) max_triangle_count = std::max(max_triangle_count, mesh.triangle_count);
+		auto index_buffer = std::make_shared<cg::resource<unsigned int>>(max_triangle_count * 3);
+		for (size_t i = 0; i < max_triangle_count * 3; i++) index_buffer->item(i) = static_cast<unsigned int>(i);
+
+		int band_count = std::max(1, std::min(omp_get_max_threads(), static_cast<int>(crop.w)));
+		std::vector<rasterizer<visibility_vertex, RT>> band_rasterizers(band_count);
+		for (int band = 0; band < band_count; band++) {
+			uint32_t band_begin = crop.y + crop.w * band / band_count;
+			uint32_t band_end = crop.y + crop.w * (band + 1) / band_count;
+			rasterizer<visibility_vertex, RT>& rasterizer = band_rasterizers[band];
+			rasterizer.set_viewport(width, height);
+			rasterizer.set_scissor(uint4{ crop.x, band_begin, crop.z, band_end - band_begin });
+			rasterizer.set_render_target(nullptr, visibility_depth);
+			rasterizer.set_visibility_buffer(visibility_buffer);
+			rasterizer.set_index_buffer(index_buffer);
+		}
+		band_rasterizers[0].clear_render_target(RT{}, 0.f);
+
+		// With the far plane behind the camera, nothing is in view
+		for (size_t mesh_id = 0; z_far > 0 && mesh_id < meshes.size(); mesh_id++) {
+			const mesh& mesh = meshes[mesh_id];
+			auto vertex_buffer = std::make_shared<cg::resource<visibility_vertex>>(mesh.triangle_count * 3);
+			#pragma omp parallel for
+			for (int t = 0; t < static_cast<int>(mesh.triangle_count); t++) {
+				hot_triangle triangle = get_hot_triangle(mesh.first_triangle + t);
+				vertex_buffer->item(t * 3).pos = float4{ triangle.a, 1.f };
+				vertex_buffer->item(t * 3 + 1).pos = float4{ triangle.a + triangle.ba, 1.f };
+				vertex_buffer->item(t * 3 + 2).pos = float4{ triangle.a + triangle.ca, 1.f };
+			}
+
+			for (size_t instance_id = 0; instance_id < instances.size(); instance_id++) {
+				if (instances[instance_id].mesh_id != mesh_id) continue;
+				float4x4 transform = mul(view_projection, instances[instance_id].transform);
+				#pragma omp parallel for num_threads(band_count)
+				for (int band = 0; band < band_count; band++) {
+					rasterizer<visibility_vertex, RT>& rasterizer = band_rasterizers[band];
+					rasterizer.set_vertex_buffer(vertex_buffer);
+					rasterizer.vertex_shader = [&](visibility_vertex vertex) {
+						vertex.pos = mul(transform, vertex.pos);
+						return vertex;
+					};
+					rasterizer.draw_visibility(mesh.triangle_count * 3, 0, static_cast<uint32_t>(instance_id));
+				}
+			}
+		}
+
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+		std::cout << "Visibility buffer: " << instances.size() << " instances rasterized in " << elapsed.count() << " ms\n";
+	}
+
+	// Intersects a camera ray through the centre of `pixel` with the triangle the visibility buffer
+	// holds there, for the exact distance and barycentrics. The two may disagree by a rounding error at
+	// the edges of triangles, where the ray is traced instead. No triangle is a miss
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::find_primary_hit(const ray& ray, size_t pixel, payload& hit, float max_t, float min_t) const
+	{
+		const visibility& seen = visibility_buffer->item(pixel);
+		if (seen.draw_id == visibility::none) return false;
+
+		thread_traversal_stats* stats = traversal_stats::is_counted && static_cast<size_t>(omp_get_thread_num()) < thread_stats.size() ? &thread_stats[omp_get_thread_num()] : nullptr;
+		if (stats) stats->visibility_rays++;
+		const instance& instance = instances[seen.draw_id];
+		size_t triangle_id = meshes[instance.mesh_id].first_triangle + seen.triangle_id;
+		hit = intersection_shader(get_hot_triangle(triangle_id), instance.to_object_space(ray));
+		if (hit.t >= min_t && hit.t < max_t) {
+			hit.triangle_id = triangle_id;
+			hit.instance_id = seen.draw_id;
+			return true;
 		}
 
+		if (stats) stats->visibility_fallbacks++;
+		hit = payload{};
+		return find_closest_hit(ray, hit, max_t, min_t);
+	}
+
+	// The history holds the mean linear radiance, the gamma approximation is applied once to it
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::resolve_history()
+	{
 		#pragma omp parallel for
 		for (int i = 0; i < static_cast<int>(history->get_number_of_elements()); i++) {
-			render_target->item(i) = cg::from_fcolor(history->item(i));
+			hdr_target->item(i) = history->item(i).mean;
+			render_target->item(i) = cg::from_fcolor(sqrt(history->item(i).mean));
+		}
+	}
+
+	// Tiles covering the crop, in Morton order of their coordinates, so that consecutive
+	// tiles and the tiles in flight on neighbouring threads touch nearby geometry
+	template<typename VB, typename RT>
+	inline std::vector<uint2> raytracer<VB, RT>::get_tile_order() const
+	{
+		auto spread_bits = [](uint32_t v) {
+			uint64_t result = 0;
+			for (int bit = 0; bit < 16; bit++) result |= static_cast<uint64_t>((v >> bit) & 1) << (bit * 2);
+			return result;
+		};
+
+		uint32_t tiles_x = static_cast<uint32_t>((crop.z + tile_size - 1) / tile_size);
+		uint32_t tiles_y = static_cast<uint32_t>((crop.w + tile_size - 1) / tile_size);
+		std::vector<std::pair<uint64_t, uint2>> keys;
+		keys.reserve(tiles_x * tiles_y);
+		for (uint32_t y = 0; y < tiles_y; y++) {
+			for (uint32_t x = 0; x < tiles_x; x++) {
+				keys.push_back({ spread_bits(x) | (spread_bits(y) << 1), uint2{ x, y } });
+			}
+		}
+		std::sort(keys.begin(), keys.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		std::vector<uint2> tiles(keys.size());
+		for (size_t i = 0; i < keys.size(); i++) tiles[i] = keys[i].second;
+		return tiles;
+	}
+
+	// Pixel rectangle (x_begin, y_begin, x_end, y_end) of a tile
+	template<typename VB, typename RT>
+	inline uint4 raytracer<VB, RT>::get_tile_bounds(uint2 tile) const
+	{
+		uint32_t x_begin = crop.x + tile.x * static_cast<uint32_t>(tile_size);
+		uint32_t y_begin = crop.y + tile.y * static_cast<uint32_t>(tile_size);
+		return uint4{
+			x_begin, y_begin,
+			std::min(x_begin + static_cast<uint32_t>(tile_size), crop.x + crop.z),
+			std::min(y_begin + static_cast<uint32_t>(tile_size), crop.y + crop.w)
+		};
+	}
+
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::is_in_crop(size_t x, size_t y) const {
+		return x >= crop.x && x < crop.x + crop.z && y >= crop.y && y < crop.y + crop.w;
+	}
+
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::get_crop_pixel_count() const { return static_cast<size_t>(crop.z) * crop.w; }
+
+	// Orders rays by a Morton code of their origin, followed by a Morton code of their
+	// octahedral-mapped direction, so that neighbouring rays tend to visit the same geometry
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::sort_ray_queue(std::vector<queued_ray>& queue) const
+	{
+		auto spread_bits = [](uint64_t v, int stride) {
+			uint64_t result = 0;
+			for (int bit = 0; bit < 10; bit++) result |= ((v >> bit) & 1) << (bit * stride);
+			return result;
+		};
+
+		float3 scene_min = tlas.get_bounds().get_min();
+		float3 scene_max = tlas.get_bounds().get_max();
+		float3 scene_scale = 1023.f / max(scene_max - scene_min, float3{ 1e-6f });
+
+		std::vector<std::pair<uint64_t, size_t>> keys(queue.size());
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(queue.size()); i++) {
+			const ray& ray = queue[i].ray;
+			uint3 cell{ clamp((ray.position - scene_min) * scene_scale, 0.f, 1023.f) };
+
+			float3 d = ray.direction / (std::abs(ray.direction.x) + std::abs(ray.direction.y) + std::abs(ray.direction.z));
+			float2 octahedral = d.z >= 0 ? float2{ d.x, d.y } : float2{
+				(1 - std::abs(d.y)) * (d.x >= 0 ? 1 : -1),
+				(1 - std::abs(d.x)) * (d.y >= 0 ? 1 : -1)
+			};
+			uint2 direction_cell{ clamp((octahedral * 0.5f + 0.5f) * 1023.f, 0.f, 1023.f) };
+
+			uint64_t origin_code = spread_bits(cell.x, 3) | (spread_bits(cell.y, 3) << 1) | (spread_bits(cell.z, 3) << 2);
+			uint64_t direction_code = spread_bits(direction_cell.x, 2) | (spread_bits(direction_cell.y, 2) << 1);
+			keys[i] = { (origin_code << 20) | direction_code, i };
+		}
+		std::sort(keys.begin(), keys.end());
+
+		std::vector<queued_ray> sorted(queue.size());
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(keys.size()); i++) {
+			sorted[i] = queue[keys[i].second];
 		}
+		queue.swap(sorted);
 	}
 
 	template<typename VB, typename RT>
 	inline payload raytracer<VB, RT>::trace_ray(
-			const ray& ray, size_t depth, float max_t, float min_t) const
+			const ray& ray, size_t depth, path_state& path, float max_t, float min_t) const
 	{
 		if (depth-- == 0) return miss_shader(ray);
 
 		payload closest_intersection {};
-		const triangle<VB>* closest_triangle = nullptr;
+		if (find_closest_hit(ray, closest_intersection, max_t, min_t) && closest_hit_shader)
+			return closest_hit_shader(ray, closest_intersection, triangle_data[closest_intersection.triangle_id], depth, path);
+
+		return miss_shader(ray);
+	}
+
+	template<typename VB, typename RT>
+	inline float3 raytracer<VB, RT>::trace_path(
+			ray ray, size_t depth, path_state& path, float max_t, float min_t) const
+	{
+		if (depth == 0) return path.throughput * miss_shader(ray).color;
+
+		payload first_hit {};
+		bool is_hit = find_closest_hit(ray, first_hit, max_t, min_t);
+		return trace_path(ray, is_hit ? &first_hit : nullptr, depth, path, max_t, min_t);
+	}
+
+	template<typename VB, typename RT>
+	inline float3 raytracer<VB, RT>::trace_path(
+			ray ray, const payload* first_hit, size_t depth, path_state& path, float max_t, float min_t) const
+	{
+		float3 radiance{ 0.f };
+		if (depth == 0) return path.throughput * miss_shader(ray).color;
+
+		payload payload = first_hit ? *first_hit : cg::renderer::payload{};
+		bool is_hit = first_hit != nullptr;
+		for (size_t segment = 0; segment < depth; segment++) {
+			if (segment > 0) {
+				payload = cg::renderer::payload{};
+				is_hit = find_closest_hit(ray, payload, max_t, min_t);
+			}
+			if (!is_hit) {
+				record_features(path, ray, nullptr);
+				return radiance + path.throughput * miss_shader(ray).color;
+			}
+			record_features(path, ray, &payload);
+
+			float3 throughput = path.throughput;
+			cg::renderer::ray next_ray;
+			bool is_alive = scatter_shader(ray, payload, triangle_data[payload.triangle_id], path, next_ray);
+			radiance += throughput * payload.color;
+			if (!is_alive || !russian_roulette(path)) return radiance;
+
+			ray = next_ray;
+		}
+
+		return radiance + path.throughput * miss_shader(ray).color;
+	}
+
+	// The running mean uses the pixel's sample count, which doesn't include the current sample yet
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::record_features(const path_state& path, const ray& ray, const payload* hit) const
+	{
+		if (!feature_shader || path.bounce != 0) return;
+
+		features sample = hit ? feature_shader(ray, *hit, triangle_data[hit->triangle_id]) : features{};
+		feature_buffer->item(path.pixel).add(sample, history->item(path.pixel).count);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::denoise()
+	{
+		std::vector<float3> result;
+		denoiser(width, height).denoise(*history, *feature_buffer, result);
+
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(result.size()); i++) {
+			hdr_target->item(i) = max(result[i], float3{ 0.f });
+			render_target->item(i) = cg::from_fcolor(sqrt(hdr_target->item(i)));
+		}
+	}
+
+	// After a few bounces a path survives with a probability that follows its throughput, and the
+	// survivors are reweighted by it, so dim paths end early while the estimate stays unbiased
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::russian_roulette(path_state& path) const
+	{
+		constexpr size_t min_bounces = 3;
+		if (path.bounce < min_bounces) return true;
+
+		float survival = std::min(maxelem(path.throughput), 0.95f);
+		if (path.sampler.get_1d() >= survival) return false;
+		path.throughput /= survival;
+		return true;
+	}
+
+	// Walks the top-level hierarchy in world space, and the bottom-level one of every instance it
+	// reaches with the ray in the object space of that instance. A leaf is tested a packet at a time,
+	// only the distance, the barycentrics and the triangle of the closest hit are kept while walking,
+	// and the payload is filled once at the end
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::find_closest_hit(
+			const ray& ray, payload& closest_intersection, float max_t, float min_t) const
+	{
+		size_t closest_triangle = 0, closest_instance = 0;
+		float u = 0.f, v = 0.f;
+		bool is_hit = false;
 		closest_intersection.t = max_t;
+		traversal_stats stats;
 
-		for (auto& aabb : acceleration_structures) {
-			if (!aabb.aabb_test(ray)) continue;
+		tlas.traverse(ray.position, ray.direction, closest_intersection.t, min_t, stats, [&](uint32_t first_instance, uint32_t instance_count) {
+			for (size_t slot = first_instance; slot < first_instance + instance_count; slot++) {
+				size_t instance_id = instance_order[slot];
+				const mesh& mesh = meshes[instances[instance_id].mesh_id];
+				cg::renderer::ray object_ray = instances[instance_id].to_object_space(ray);
+				packet_ray object_packet_ray(object_ray.position, object_ray.direction);
 
-			for (auto& triangle : aabb.get_triangles()) {
-				payload payload = intersection_shader(triangle, ray);
+				mesh.blas.traverse(object_ray.position, object_ray.direction, closest_intersection.t, min_t, stats, [&](uint32_t first, uint32_t count) {
+					size_t begin = mesh.first_triangle + first;
+					size_t end = begin + count;
+					for (size_t packet = begin / packet_width; packet * packet_width < end; packet++) {
+						size_t packet_begin = packet * packet_width;
+						size_t first_lane = std::max(begin, packet_begin) - packet_begin;
+						size_t end_lane = std::min(end, packet_begin + packet_width) - packet_begin;
+						int lane = packet_data[packet].intersect(object_packet_ray, first_lane, end_lane, min_t, closest_intersection.t, u, v);
+						if (lane < 0) continue;
 
-				if (payload.t >= min_t && closest_intersection.t > payload.t) {
-					closest_intersection = payload;
-					closest_triangle = &triangle;
-				}
+						closest_triangle = packet_begin + lane;
+						closest_instance = instance_id;
+						is_hit = true;
+					}
+				});
 			}
+		});
+
+		add_traversal_stats(stats, false);
+		if (is_hit) {
+			closest_intersection.bary = float3{ 1 - v - u, u, v };
+			closest_intersection.triangle_id = closest_triangle;
+			closest_intersection.instance_id = closest_instance;
 		}
+		return is_hit;
+	}
 
-		if (closest_triangle && closest_hit_shader)
-			return closest_hit_shader(ray, closest_intersection, *closest_triangle, depth);
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::trace_occlusion(const ray& ray, float max_t, float min_t) const
+	{
+		traversal_stats stats;
+		bool is_occluded = tlas.traverse_any(ray.position, ray.direction, max_t, min_t, stats, [&](uint32_t first_instance, uint32_t instance_count) {
+			for (size_t slot = first_instance; slot < first_instance + instance_count; slot++) {
+				size_t instance_id = instance_order[slot];
+				const mesh& mesh = meshes[instances[instance_id].mesh_id];
+				cg::renderer::ray object_ray = instances[instance_id].to_object_space(ray);
 
-		return miss_shader(ray);
+				packet_ray object_packet_ray(object_ray.position, object_ray.direction);
+
+				bool is_mesh_hit = mesh.blas.traverse_any(object_ray.position, object_ray.direction, max_t, min_t, stats, [&](uint32_t first, uint32_t count) {
+					size_t begin = mesh.first_triangle + first;
+					size_t end = begin + count;
+					for (size_t packet = begin / packet_width; packet * packet_width < end; packet++) {
+						size_t packet_begin = packet * packet_width;
+						size_t first_lane = std::max(begin, packet_begin) - packet_begin;
+						size_t end_lane = std::min(end, packet_begin + packet_width) - packet_begin;
+						if (packet_data[packet].intersect_any(object_packet_ray, first_lane, end_lane, min_t, max_t)) return true;
+					}
+					return false;
+				});
+				if (is_mesh_hit) return true;
+			}
+			return false;
+		});
+		add_traversal_stats(stats, true);
+		return is_occluded;
 	}
 
 	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::intersection_shader(const triangle<VB>& triangle, const ray& ray) const {
+	inline payload raytracer<VB, RT>::intersection_shader(const hot_triangle& triangle, const ray& ray) const {
 		payload payload {};
 		payload.t = -1;
 		constexpr float tolerance = 1e-8f;
@@ -251,52 +1750,42 @@ namespace cg::renderer
 	}
 
 	template<typename VB, typename RT>
-	float2 raytracer<VB, RT>::get_jitter(int frame_id) {
-		float2 result{ -0.5f };
-		
-		constexpr int base_x = 2, base_y = 3;
+	inline size_t raytracer<VB, RT>::get_triangle_count() const { return triangle_count; }
 
-		float inv_base = 1.f / base_x;
-		float fraction = inv_base;
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::get_mesh_count() const { return meshes.size(); }
 
-		for(int index = frame_id + 1; index > 0; index /= base_x) {
-			result.x += (index % base_x) * fraction;
-			fraction *= inv_base;
-		}
+	template<typename VB, typename RT>
+	inline const mesh& raytracer<VB, RT>::get_mesh(size_t mesh_id) const { return meshes[mesh_id]; }
 
-		inv_base = 1.f / base_y;
-		fraction = inv_base;
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::get_instance_count() const { return instances.size(); }
 
-		for(int index = frame_id + 1; index > 0; index /= base_y) {
-			result.y += (index % base_y) * fraction;
-			fraction *= inv_base;
-		}
+	template<typename VB, typename RT>
+	inline const instance& raytracer<VB, RT>::get_instance(size_t instance_id) const { return instances[instance_id]; }
 
-		return result;
+	template<typename VB, typename RT>
+	inline hot_triangle raytracer<VB, RT>::get_hot_triangle(size_t triangle_id) const
+	{
+		const triangle_packet& packet = packet_data[triangle_id / packet_width];
+		size_t lane = triangle_id % packet_width;
+		hot_triangle triangle;
+		triangle.a = packet.get_a(lane);
+		triangle.ba = packet.get_ba(lane);
+		triangle.ca = packet.get_ca(lane);
+		return triangle;
 	}
 
-
-	template<typename VB>
-	inline void aabb<VB>::add_triangle(const triangle<VB> triangle) {
-		if (triangles.empty()) aabb_min = aabb_max = triangle.a;
-
-		triangles.push_back(triangle);
-		aabb_max = max(aabb_max, max(triangle.c, max(triangle.b, triangle.a)));
-		aabb_min = min(aabb_min, min(triangle.c, min(triangle.b, triangle.a)));
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_hot_triangle(size_t triangle_id, const hot_triangle& triangle)
+	{
+		triangle_packets[triangle_id / packet_width].set_triangle(triangle_id % packet_width, triangle.a, triangle.ba, triangle.ca);
 	}
 
-	template<typename VB>
-	inline const std::vector<triangle<VB>>& aabb<VB>::get_triangles() const { return triangles; }
-
-	template<typename VB>
-	inline bool aabb<VB>::aabb_test(const ray& ray) const {
-		float3 inv_ray_dir = 1 / ray.direction;
-		float3 t0 = (aabb_max - ray.position) * inv_ray_dir;
-		float3 t1 = (aabb_min - ray.position) * inv_ray_dir;
+	template<typename VB, typename RT>
+	inline const triangle<VB>& raytracer<VB, RT>::get_triangle(size_t triangle_id) const { return triangle_data[triangle_id]; }
 
-		float3 t_min = min(t0, t1);
-		float3 t_max = max(t0, t1);
-		return maxelem(t_min) <= maxelem(t_max);	
-	}
+	template<typename VB, typename RT>
+	inline const material& raytracer<VB, RT>::get_material(unsigned int material_id) const { return materials[material_id]; }
 
 } // namespace cg::renderer
\ No newline at end of file
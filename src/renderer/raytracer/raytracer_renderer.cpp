@@ -1,22 +1,63 @@
 #include "raytracer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
 constexpr float default_fov = (float)M_PI_2;
+constexpr size_t no_light = std::numeric_limits<size_t>::max();
 
 void cg::renderer::ray_tracing_renderer::init() {
-	model = std::make_shared<cg::world::model>(settings->model_path);
-
 	raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::ucolor>>();
 	raytracer->set_viewport(settings->width, settings->height);
 	render_target = std::make_shared<cg::resource<cg::ucolor>>(settings->width, settings->height);
 	raytracer->set_render_target(render_target);
-	raytracer->set_vertex_buffers(model->get_vertex_buffers());
-	raytracer->set_index_buffers(model->get_index_buffers());
+	if (settings->raytracing_bvh_builder == "sah") raytracer->set_bvh_builder(bvh_builder::sah, settings->raytracing_sbvh_budget);
+	else if (settings->raytracing_bvh_builder == "sbvh") raytracer->set_bvh_builder(bvh_builder::sbvh, settings->raytracing_sbvh_budget);
+	else if (settings->raytracing_bvh_builder == "lbvh") raytracer->set_bvh_builder(bvh_builder::lbvh, settings->raytracing_sbvh_budget);
+	else THROW_ERROR("Unknown BVH builder: " + settings->raytracing_bvh_builder);
+	raytracer->set_bvh_quantization(settings->raytracing_quantize_bvh);
+	raytracer->set_hybrid(settings->raytracing_hybrid);
+
+	// With a cached acceleration structure the raytracer needs nothing from the OBJ file, so it isn't parsed
+	PRINT_EXECUTION_TIME("Scene loading time",
+		if (!settings->bvh_cache_path.empty()) {
+			model_hash = cg::world::model::get_file_hash(settings->model_path);
+			std::ostringstream file_name;
+			file_name << settings->model_path.stem().string() << "-" << std::hex << model_hash << ".bvh";
+			std::filesystem::create_directories(settings->bvh_cache_path);
+			bvh_cache_file = settings->bvh_cache_path / file_name.str();
+			is_bvh_cached = raytracer->load_acceleration_structure(bvh_cache_file, model_hash);
+		}
+		if (is_bvh_cached) {
+			model = std::make_shared<cg::world::model>();
+		} else {
+			model = std::make_shared<cg::world::model>(settings->model_path);
+			raytracer->set_vertex_buffers(model->get_vertex_buffers());
+			raytracer->set_index_buffers(model->get_index_buffers());
+		}
+	);
+
+	if (settings->raytracing_sampler == "random") raytracer->set_sampler(sampler_type::random, settings->raytracing_seed);
+	else if (settings->raytracing_sampler == "sobol") raytracer->set_sampler(sampler_type::sobol, settings->raytracing_seed);
+	else if (settings->raytracing_sampler == "blue_noise") raytracer->set_sampler(sampler_type::blue_noise, settings->raytracing_seed);
+	else THROW_ERROR("Unknown sampler: " + settings->raytracing_sampler);
+	raytracer->set_tile_size(settings->raytracing_tile_size);
+	const std::vector<unsigned>& crop = settings->raytracing_crop;
+	if (crop[2] != 0 || crop[3] != 0) raytracer->set_crop(uint4{ crop[0], crop[1], crop[2], crop[3] });
+	raytracer->set_sample_offset(settings->raytracing_sample_offset);
+	raytracer->set_adaptive_sampling(settings->raytracing_adaptive_threshold, settings->raytracing_error_target, settings->raytracing_time_budget);
+	raytracer->set_checkpoint(settings->checkpoint_path, settings->raytracing_checkpoint_interval);
+	if (settings->raytracing_wavefront && (settings->raytracing_adaptive_threshold > 0 || settings->raytracing_error_target > 0 || settings->raytracing_time_budget > 0))
+		std::cerr << "Warning: adaptive sampling isn't supported by the wavefront mode, every pixel gets " << settings->accumulation_num << " samples\n";
 
 	camera = std::make_shared<cg::world::camera>();
 	camera->set_height(static_cast<float>(settings->height));
@@ -37,40 +78,274 @@ cg::renderer::payload black_shader(const cg::renderer::ray& ray) {
 	return payload; 
 }
 
+float power_heuristic(float pdf, float other_pdf) {
+	return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+float3 cosine_sample_hemisphere(float3 normal, float2 sample) {
+	float radius = sqrt(sample.x);
+	float phi = 2 * static_cast<float>(M_PI) * sample.y;
+	float3 tangent = normalize(cross(std::abs(normal.x) > 0.1f ? float3{ 0, 1, 0 } : float3{ 1, 0, 0 }, normal));
+	float3 bitangent = cross(normal, tangent);
+
+	return tangent * (radius * cos(phi)) + bitangent * (radius * sin(phi)) + normal * sqrt(std::max(0.f, 1 - sample.x));
+}
+
+// Places the model at its world matrix, and its copies on a grid next to it. The copies only add
+// instances, all of them trace the same geometry
+void cg::renderer::ray_tracing_renderer::add_instances() {
+	aabb model_bounds;
+	for (size_t mesh_id = 0; mesh_id < raytracer->get_mesh_count(); mesh_id++) model_bounds.add_aabb(raytracer->get_mesh(mesh_id).blas.get_bounds());
+	instance_spacing = (model_bounds.get_max() - model_bounds.get_min()) * 1.25f;
+
+	unsigned grid = settings->instance_grid;
+	for (unsigned z = 0; z < grid; z++) {
+		for (unsigned x = 0; x < grid; x++) {
+			for (size_t mesh_id = 0; mesh_id < raytracer->get_mesh_count(); mesh_id++) raytracer->add_instance(mesh_id, get_instance_transform(x, z, 0));
+		}
+	}
+}
+
+// Every copy on the grid bobs up and down over the animation, out of phase with its neighbours.
+// The first frame is the still grid
+float4x4 cg::renderer::ray_tracing_renderer::get_instance_transform(unsigned x, unsigned z, unsigned frame) const {
+	float amplitude = instance_spacing.y * 0.1f;
+	float phase = 2 * static_cast<float>(M_PI) * frame / static_cast<float>(settings->animation_frames);
+	float3 offset{ instance_spacing.x * x, amplitude * sin(phase) * cos(static_cast<float>(x + z)), -instance_spacing.z * z };
+	return mul(linalg::translation_matrix(offset), model->get_world_matrix());
+}
+
+void cg::renderer::ray_tracing_renderer::animate_instances(unsigned frame) {
+	size_t instance_id = 0;
+	unsigned grid = settings->instance_grid;
+	for (unsigned z = 0; z < grid; z++) {
+		for (unsigned x = 0; x < grid; x++) {
+			float4x4 transform = get_instance_transform(x, z, frame);
+			for (size_t mesh_id = 0; mesh_id < raytracer->get_mesh_count(); mesh_id++) raytracer->set_instance_transform(instance_id++, transform);
+		}
+	}
+}
+
+// A standing wave runs across the model over the animation, moving every vertex along y by up to a
+// twentieth of the height of the model, and every mesh is updated. Normals are kept as they are.
+// The first frame is the still model
+void cg::renderer::ray_tracing_renderer::deform_meshes(unsigned frame) {
+	auto& vertex_buffers = model->get_vertex_buffers();
+	if (rest_positions.empty()) {
+		for (auto& vertex_buffer : vertex_buffers) {
+			std::vector<float4> positions(vertex_buffer->get_number_of_elements());
+			for (size_t i = 0; i < positions.size(); i++) positions[i] = vertex_buffer->item(i).pos;
+			rest_positions.push_back(positions);
+		}
+	}
+
+	float amplitude = instance_spacing.y * 0.05f / 1.25f;
+	float wave_number = 2 * static_cast<float>(M_PI) / std::max(std::max(instance_spacing.x, instance_spacing.z), std::numeric_limits<float>::min());
+	float phase = 2 * static_cast<float>(M_PI) * frame / static_cast<float>(settings->animation_frames);
+	for (size_t mesh_id = 0; mesh_id < vertex_buffers.size(); mesh_id++) {
+		for (size_t i = 0; i < rest_positions[mesh_id].size(); i++) {
+			float4 position = rest_positions[mesh_id][i];
+			position.y += amplitude * sin(phase) * cos(wave_number * (position.x + position.z));
+			vertex_buffers[mesh_id]->item(i).pos = position;
+		}
+		raytracer->update_mesh(mesh_id);
+	}
+}
+
+// Emissive triangles are picked proportionally to their power
+void cg::renderer::ray_tracing_renderer::collect_lights() {
+	lights.clear();
+	light_cdf.clear();
+	light_pmf.clear();
+	first_lights.assign(raytracer->get_instance_count(), 0);
+	mesh_light_ids.assign(raytracer->get_triangle_count(), no_light);
+
+	// The lights of a mesh are numbered in the order of its index buffer rather than of its leaves, so that
+	// the numbering doesn't depend on the builder, and the copies of a triangle that spatial splits put in
+	// several leaves share a light
+	std::vector<std::vector<size_t>> mesh_lights(raytracer->get_mesh_count());
+	for (size_t mesh_id = 0; mesh_id < raytracer->get_mesh_count(); mesh_id++) {
+		const mesh& mesh = raytracer->get_mesh(mesh_id);
+		std::map<uint32_t, size_t> source_lights;
+		for (size_t i = mesh.first_triangle; i < mesh.first_triangle + mesh.triangle_count; i++) {
+			const material& material = raytracer->get_material(raytracer->get_triangle(i).material_id);
+			hot_triangle geometry = raytracer->get_hot_triangle(i);
+			float power = length(cross(geometry.ba, geometry.ca)) * dot(material.emissive, float3{ 0.2126f, 0.7152f, 0.0722f });
+			if (power > 0) source_lights.insert({ mesh.source_triangles[i - mesh.first_triangle], i });
+		}
+		for (auto& [source, triangle_id] : source_lights) {
+			mesh_light_ids[triangle_id] = mesh_lights[mesh_id].size();
+			mesh_lights[mesh_id].push_back(triangle_id);
+		}
+		for (size_t i = mesh.first_triangle; i < mesh.first_triangle + mesh.triangle_count; i++) {
+			auto light = source_lights.find(mesh.source_triangles[i - mesh.first_triangle]);
+			if (light != source_lights.end()) mesh_light_ids[i] = mesh_light_ids[light->second];
+		}
+	}
+
+	float total_power = 0.f;
+	for (size_t instance_id = 0; instance_id < raytracer->get_instance_count(); instance_id++) {
+		const instance& instance = raytracer->get_instance(instance_id);
+		first_lights[instance_id] = lights.size();
+		for (size_t i : mesh_lights[instance.mesh_id]) {
+
+			const material& material = raytracer->get_material(raytracer->get_triangle(i).material_id);
+			hot_triangle object_geometry = raytracer->get_hot_triangle(i);
+			hot_triangle geometry(
+				instance.to_world_point(object_geometry.a),
+				instance.to_world_point(object_geometry.a + object_geometry.ba),
+				instance.to_world_point(object_geometry.a + object_geometry.ca));
+			float area = length(cross(geometry.ba, geometry.ca)) / 2;
+
+			lights.push_back({ geometry, area, material.emissive });
+			total_power += area * dot(material.emissive, float3{ 0.2126f, 0.7152f, 0.0722f });
+			light_cdf.push_back(total_power);
+		}
+	}
+
+	light_pmf.resize(lights.size());
+	for (size_t i = 0; i < lights.size(); i++) {
+		light_cdf[i] /= total_power;
+		light_pmf[i] = light_cdf[i] - (i == 0 ? 0.f : light_cdf[i - 1]);
+	}
+}
+
+size_t cg::renderer::ray_tracing_renderer::get_light_id(size_t instance_id, size_t triangle_id) const {
+	if (mesh_light_ids[triangle_id] == no_light) return no_light;
+	return first_lights[instance_id] + mesh_light_ids[triangle_id];
+}
+
+// Solid angle pdf of reaching a point at distance `t` along `ray` by sampling the lights
+float cg::renderer::ray_tracing_renderer::get_light_pdf(size_t light_id, const ray& ray, float t) const {
+	if (light_id == no_light || light_pmf[light_id] == 0) return 0.f;
+
+	const light& light = lights[light_id];
+	float3 light_normal = cross(light.geometry.ba, light.geometry.ca);
+	float cos_light = std::abs(dot(light_normal, ray.direction)) / (2 * light.area);
+	if (cos_light <= 0) return 0.f;
+
+	return light_pmf[light_id] * t * t / (light.area * cos_light);
+}
+
+// Next event estimation: the contribution of a random point on a random light, if it's visible
+cg::fcolor cg::renderer::ray_tracing_renderer::sample_direct_light(
+		float3 position, float3 normal, const material& material, sampler& sampler, bool use_mis) const {
+	float light_sample = sampler.get_1d();
+	float2 point_sample = sampler.get_2d();
+	if (lights.empty()) return cg::fcolor{ 0.f };
+
+	size_t light_id = std::lower_bound(light_cdf.begin(), light_cdf.end(), light_sample) - light_cdf.begin();
+	light_id = std::min(light_id, lights.size() - 1);
+	const hot_triangle& geometry = lights[light_id].geometry;
+
+	float sqrt_u = sqrt(point_sample.x);
+	float3 light_position = geometry.a + geometry.ba * (sqrt_u * (1 - point_sample.y)) + geometry.ca * (sqrt_u * point_sample.y);
+	float3 to_light = light_position - position;
+	float distance = length(to_light);
+	cg::renderer::ray shadow_ray(position, to_light);
+
+	float cos_surface = dot(normal, shadow_ray.direction);
+	float light_pdf = get_light_pdf(light_id, shadow_ray, distance);
+	if (cos_surface <= 0 || light_pdf <= 0) return cg::fcolor{ 0.f };
+
+	if (raytracer->trace_occlusion(shadow_ray, distance * (1 - 1e-3f))) return cg::fcolor{ 0.f };
+
+	float bsdf_pdf = cos_surface / static_cast<float>(M_PI);
+	float weight = use_mis ? power_heuristic(light_pdf, bsdf_pdf) : 1.f;
+	return lights[light_id].emissive * material.diffuse / static_cast<float>(M_PI) * cos_surface / light_pdf * weight;
+}
+
 void cg::renderer::ray_tracing_renderer::render() {
 	raytracer->miss_shader = black_shader;
-	std::random_device random_device;
-	std::mt19937 random_generator(random_device());
-	std::uniform_real_distribution<float> uni_dist(-1, 1);
-	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) {
-		payload.color = triangle.emissive;
+	// Lambertian surfaces, lit by BSDF sampling and light sampling combined with multiple importance sampling
+	raytracer->scatter_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, path_state& path, cg::renderer::ray& next_ray) {
+		const material& material = raytracer->get_material(triangle.material_id);
+		const instance& instance = raytracer->get_instance(payload.instance_id);
+		hot_triangle geometry = raytracer->get_hot_triangle(payload.triangle_id);
 		float3 position = ray.position + ray.direction * payload.t;
-		float3 normal = payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc;
-		
-		float3 rand_direction(uni_dist(random_generator), uni_dist(random_generator), uni_dist(random_generator));
-		if (dot(rand_direction, normal) < 0) rand_direction *= -1;
-		cg::renderer::ray new_ray(position, rand_direction);
-		cg::renderer::payload next_payload = raytracer->trace_ray(new_ray, depth);
-		payload.color += next_payload.color * triangle.diffuse * std::max(0.f, dot(normal, new_ray.direction));
-
-		return payload;
+		float3 normal = normalize(instance.to_world_normal(payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc));
+		float3 geometric_normal = instance.to_world_normal(cross(geometry.ba, geometry.ca));
+		if (dot(geometric_normal, ray.direction) > 0) geometric_normal *= -1;
+		if (dot(normal, geometric_normal) < 0) normal *= -1;
+
+		// The last bounce can't find lights by BSDF sampling, so light sampling takes all the weight there
+		bool is_last_bounce = path.bounce + 1 >= settings->raytracing_depth;
+		float emission_weight = path.bsdf_pdf > 0 ? power_heuristic(path.bsdf_pdf, get_light_pdf(get_light_id(payload.instance_id, payload.triangle_id), ray, payload.t)) : 1.f;
+		payload.color = material.emissive * emission_weight;
+		payload.color += sample_direct_light(position, normal, material, path.sampler, !is_last_bounce);
+
+		next_ray = cg::renderer::ray(position, cosine_sample_hemisphere(normal, path.sampler.get_2d()));
+		float cos_theta = dot(normal, next_ray.direction);
+		if (cos_theta <= 0) return false;
+
+		// Lambertian BSDF over the cosine-weighted pdf leaves just the albedo
+		path.throughput *= material.diffuse;
+		path.bsdf_pdf = cos_theta / static_cast<float>(M_PI);
+		path.bounce++;
+		return true;
 	};
+	if (settings->raytracing_denoise) {
+		raytracer->feature_shader = [&](const ray& ray, const payload& payload, const triangle<cg::vertex>& triangle) {
+			const instance& instance = raytracer->get_instance(payload.instance_id);
+			float3 normal = normalize(instance.to_world_normal(payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc));
+			if (dot(normal, ray.direction) > 0) normal *= -1;
+			const material& material = raytracer->get_material(triangle.material_id);
+			return features{ material.emissive, material.diffuse, normal, payload.t };
+		};
+	}
 
-	raytracer->build_acceleration_structure();
-	raytracer->clear_render_target({0, 0, 0});
-
-	PRINT_EXECUTION_TIME("Ray tracing time",
-		raytracer->ray_generation(
-				camera->get_position(), 
-				camera->get_forward(), 
-				camera->get_right(), 
-				camera->get_up(), 
-				settings->raytracing_use_fov ? camera->get_fov() : default_fov,
-				settings->raytracing_depth, 
-				settings->accumulation_num
-		);
+	PRINT_EXECUTION_TIME("Acceleration structure build time",
+		raytracer->build_meshes();
+		add_instances();
+		raytracer->build_acceleration_structure();
 	);
+	if (!bvh_cache_file.empty() && !is_bvh_cached) raytracer->save_acceleration_structure(bvh_cache_file, model_hash);
 
-	cg::utils::save_resource(*render_target, settings->result_path);
-	if (settings->show_render) cg::utils::open_file_with_system_app(settings->result_path);
-}
\ No newline at end of file
+	auto ray_generation = settings->raytracing_wavefront ?
+		&cg::renderer::raytracer<cg::vertex, cg::ucolor>::wavefront_ray_generation :
+		&cg::renderer::raytracer<cg::vertex, cg::ucolor>::ray_generation;
+
+	std::filesystem::path result_path = settings->result_path;
+	for (unsigned frame = 0; frame < settings->animation_frames; frame++) {
+		if (frame > 0) {
+			PRINT_EXECUTION_TIME("Acceleration structure update time",
+				animate_instances(frame);
+				if (settings->deform_meshes) deform_meshes(frame);
+				raytracer->update_acceleration_structure();
+			);
+		}
+		collect_lights();
+		raytracer->clear_render_target({0, 0, 0});
+		if (settings->raytracing_resume) raytracer->resume(settings->checkpoint_path, settings->raytracing_depth);
+
+		PRINT_EXECUTION_TIME("Ray tracing time",
+			((*raytracer).*ray_generation)(
+					camera->get_position(), 
+					camera->get_forward(), 
+					camera->get_right(), 
+					camera->get_up(), 
+					settings->raytracing_use_fov ? camera->get_fov() : default_fov,
+					settings->raytracing_depth, 
+					settings->accumulation_num
+			);
+		);
+
+		if (settings->raytracing_denoise) {
+			PRINT_EXECUTION_TIME("Denoise time", raytracer->denoise(););
+		}
+
+		result_path = get_frame_path(settings->result_path, frame);
+		cg::utils::save_resource(*render_target, result_path);
+		if (!settings->hdr_result_path.empty()) cg::utils::save_resource(*raytracer->get_hdr_target(), get_frame_path(settings->hdr_result_path, frame));
+	}
+	if (settings->show_render) cg::utils::open_file_with_system_app(result_path);
+}
+
+// Frames of an animation get their number before the extension
+std::filesystem::path cg::renderer::ray_tracing_renderer::get_frame_path(const std::filesystem::path& path, unsigned frame) const {
+	if (settings->animation_frames <= 1) return path;
+
+	std::ostringstream file_name;
+	file_name << path.stem().string() << "_" << std::setw(4) << std::setfill('0') << frame << path.extension().string();
+	return path.parent_path() / file_name.str();
+}
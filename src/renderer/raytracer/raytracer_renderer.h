@@ -18,8 +18,30 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<cg::ucolor>> render_target;
 
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::ucolor>> raytracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::ucolor>> shadow_raytracer;
+		std::filesystem::path bvh_cache_file;
+		uint64_t model_hash = 0;
+		bool is_bvh_cached = false;
+		float3 instance_spacing{ 0.f };
+		// Positions of the vertices of every mesh before `deform_meshes` moved them
+		std::vector<std::vector<float4>> rest_positions;
 
 		std::vector<cg::renderer::light> lights;
+		std::vector<float> light_cdf;
+		// Probability of picking every light in `sample_direct_light`
+		std::vector<float> light_pmf;
+		// Every instance of a mesh has the same lights, so a light is found by the first light of its
+		// instance and the index of its triangle among the emissive triangles of the mesh
+		std::vector<size_t> first_lights;
+		std::vector<size_t> mesh_light_ids;
+
+		void collect_lights();
+		void add_instances();
+		float4x4 get_instance_transform(unsigned x, unsigned z, unsigned frame) const;
+		void animate_instances(unsigned frame);
+		void deform_meshes(unsigned frame);
+		std::filesystem::path get_frame_path(const std::filesystem::path& path, unsigned frame) const;
+		size_t get_light_id(size_t instance_id, size_t triangle_id) const;
+		float get_light_pdf(size_t light_id, const ray& ray, float t) const;
+		cg::fcolor sample_direct_light(float3 position, float3 normal, const material& material, sampler& sampler, bool use_mis) const;
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	enum class sampler_type
+	{
+		random,
+		sobol,
+		blue_noise
+	};
+
+	// Source of random numbers for a single sample of a single pixel. Every sampler
+	// owns its state and is seeded from (pixel, sample index, seed) only, so the
+	// sequence it returns doesn't depend on the thread that uses it
+	class sampler
+	{
+	public:
+		sampler() {}
+		sampler(sampler_type type, unsigned int pixel_x, unsigned int pixel_y, unsigned int sample_index, unsigned int seed);
+
+		float get_1d();
+		float2 get_2d();
+
+	protected:
+		sampler_type type = sampler_type::random;
+		uint32_t pixel_x = 0;
+		uint32_t pixel_y = 0;
+		uint32_t sample_index = 0;
+		uint32_t seed = 0;
+		uint32_t pixel_seed = 0;
+		uint32_t dimension = 0;
+		uint64_t pcg_state = 0;
+
+		uint32_t next_pcg();
+		float2 get_sobol(uint32_t dimension_seed) const;
+	};
+
+	namespace sampling
+	{
+		constexpr int blue_noise_size = 64;
+
+		// Integer hash with good avalanche (lowbias32 by Chris Wellons)
+		inline uint32_t hash(uint32_t x)
+		{
+			x ^= x >> 16;
+			x *= 0x7feb352du;
+			x ^= x >> 15;
+			x *= 0x846ca68bu;
+			x ^= x >> 16;
+			return x;
+		}
+
+		inline uint32_t hash_combine(uint32_t seed, uint32_t value) { return hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2))); }
+
+		inline float to_float(uint32_t x) { return static_cast<float>(x >> 8) * (1.f / 16777216.f); }
+
+		inline uint32_t reverse_bits(uint32_t x)
+		{
+			x = (x << 16) | (x >> 16);
+			x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+			x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+			x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+			x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+			return x;
+		}
+
+		// Owen scrambling of a 32-bit fixed point value, "Practical Hash-based Owen Scrambling" (Burley 2020)
+		inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+		{
+			x = reverse_bits(x);
+			x += seed;
+			x ^= x * 0x6c50b47cu;
+			x ^= x * 0xb82f1e52u;
+			x ^= x * 0xc7afe638u;
+			x ^= x * 0x8d22f6e6u;
+			return reverse_bits(x);
+		}
+
+		// The first two dimensions of the Sobol sequence, as 32-bit fixed point values
+		inline uint2 sobol_2d(uint32_t index)
+		{
+			uint2 result{ reverse_bits(index), 0 };
+			for (uint32_t direction = 1u << 31; index; index >>= 1, direction ^= direction >> 1) {
+				if (index & 1) result.y ^= direction;
+			}
+			return result;
+		}
+
+		// A 64x64 tile of blue noise ranks in [0, 1), built once with Ulichney's void-and-cluster method
+		inline const std::vector<float>& get_blue_noise()
+		{
+			static const std::vector<float> blue_noise = [] {
+				constexpr int size = blue_noise_size;
+				constexpr int count = size * size;
+				constexpr float sigma = 1.5f;
+
+				std::vector<float> kernel(count);
+				for (int y = 0; y < size; y++) {
+					for (int x = 0; x < size; x++) {
+						int dx = std::min(x, size - x);
+						int dy = std::min(y, size - y);
+						kernel[x + y * size] = std::exp(-static_cast<float>(dx * dx + dy * dy) / (2 * sigma * sigma));
+					}
+				}
+
+				std::vector<char> pattern(count, 0);
+				std::vector<float> energy(count, 0.f);
+				auto toggle = [&](int pixel, float sign) {
+					pattern[pixel] = sign > 0;
+					int px = pixel % size;
+					int py = pixel / size;
+					for (int y = 0; y < size; y++) {
+						for (int x = 0; x < size; x++) {
+							int kx = (x - px) & (size - 1);
+							int ky = (y - py) & (size - 1);
+							energy[x + y * size] += sign * kernel[kx + ky * size];
+						}
+					}
+				};
+				auto find = [&](char value, bool highest) {
+					int best = -1;
+					for (int i = 0; i < count; i++) {
+						if (pattern[i] != value) continue;
+						if (best < 0 || (highest ? energy[i] > energy[best] : energy[i] < energy[best])) best = i;
+					}
+					return best;
+				};
+
+				// Initial binary pattern: random points, relaxed by moving the tightest cluster into the largest void
+				uint32_t state = 1;
+				int initial_count = count / 10;
+				for (int placed = 0; placed < initial_count;) {
+					state = hash(state);
+					int pixel = static_cast<int>(state % count);
+					if (!pattern[pixel]) {
+						toggle(pixel, 1.f);
+						placed++;
+					}
+				}
+				for (int iteration = 0; iteration < count; iteration++) {
+					int cluster = find(1, true);
+					toggle(cluster, -1.f);
+					int void_pixel = find(0, false);
+					toggle(void_pixel, 1.f);
+					if (void_pixel == cluster) break;
+				}
+
+				std::vector<int> ranks(count, 0);
+				std::vector<char> initial_pattern = pattern;
+				std::vector<float> initial_energy = energy;
+
+				// Phase 1: rank the initial points, removing the tightest cluster each time
+				for (int rank = initial_count - 1; rank >= 0; rank--) {
+					int cluster = find(1, true);
+					toggle(cluster, -1.f);
+					ranks[cluster] = rank;
+				}
+
+				// Phases 2 and 3: fill the largest void each time. The energies of the ones and of the zeros
+				// sum up to a constant on a torus, so this is the same as removing the tightest cluster of zeros
+				pattern = initial_pattern;
+				energy = initial_energy;
+				for (int rank = initial_count; rank < count; rank++) {
+					int void_pixel = find(0, false);
+					toggle(void_pixel, 1.f);
+					ranks[void_pixel] = rank;
+				}
+
+				std::vector<float> result(count);
+				for (int i = 0; i < count; i++) {
+					result[i] = (ranks[i] + 0.5f) / count;
+				}
+				return result;
+			}();
+
+			return blue_noise;
+		}
+	} // namespace sampling
+
+	inline sampler::sampler(sampler_type type, unsigned int pixel_x, unsigned int pixel_y, unsigned int sample_index, unsigned int seed) :
+		type(type), pixel_x(pixel_x), pixel_y(pixel_y), sample_index(sample_index), seed(sampling::hash(seed)),
+		pixel_seed(sampling::hash_combine(sampling::hash_combine(this->seed, pixel_x), pixel_y))
+	{
+		if (type != sampler_type::random) return;
+
+		// PCG32 initialization with the pixel as the stream and the sample index as the start state
+		uint64_t initial_state = (static_cast<uint64_t>(sampling::hash(sample_index)) << 32) | sampling::hash_combine(pixel_seed, sample_index);
+		pcg_state = 0;
+		next_pcg();
+		pcg_state += initial_state;
+		next_pcg();
+	}
+
+	inline uint32_t sampler::next_pcg()
+	{
+		uint64_t increment = (static_cast<uint64_t>(pixel_seed) << 1) | 1u;
+		uint64_t old_state = pcg_state;
+		pcg_state = old_state * 6364136223846793005ull + increment;
+		uint32_t xor_shifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+		uint32_t rotation = static_cast<uint32_t>(old_state >> 59u);
+		return (xor_shifted >> rotation) | (xor_shifted << ((~rotation + 1u) & 31));
+	}
+
+	// An Owen-scrambled Sobol point: the index is shuffled and both dimensions are scrambled with
+	// seeds derived from `dimension_seed`, so that every pair of dimensions is decorrelated
+	inline float2 sampler::get_sobol(uint32_t dimension_seed) const
+	{
+		uint32_t index = sampling::nested_uniform_scramble(sample_index, dimension_seed);
+		uint2 point = sampling::sobol_2d(index);
+		return float2{
+			sampling::to_float(sampling::nested_uniform_scramble(point.x, sampling::hash_combine(dimension_seed, 1))),
+			sampling::to_float(sampling::nested_uniform_scramble(point.y, sampling::hash_combine(dimension_seed, 2)))
+		};
+	}
+
+	// Quasi-random samplers spend a whole pair of dimensions on a 1D sample
+	inline float sampler::get_1d()
+	{
+		if (type == sampler_type::random) return sampling::to_float(next_pcg());
+		return get_2d().x;
+	}
+
+	inline float2 sampler::get_2d()
+	{
+		uint32_t current_dimension = dimension++;
+
+		switch (type) {
+			case sampler_type::random:
+				return float2{ sampling::to_float(next_pcg()), sampling::to_float(next_pcg()) };
+			case sampler_type::sobol:
+				return get_sobol(sampling::hash_combine(pixel_seed, current_dimension));
+			case sampler_type::blue_noise: {
+				// The same scrambled sequence for every pixel, shifted toroidally by a blue noise mask
+				// ("Blue-noise dithered sampling", Georgiev and Fajardo 2016), with the mask offset
+				// along the R2 sequence for every dimension
+				constexpr int size = sampling::blue_noise_size;
+				const std::vector<float>& blue_noise = sampling::get_blue_noise();
+				uint32_t offset_x = static_cast<uint32_t>(current_dimension * 0.7548776662f * size);
+				uint32_t offset_y = static_cast<uint32_t>(current_dimension * 0.5698402910f * size);
+				uint32_t x = (pixel_x + offset_x) % size;
+				uint32_t y = (pixel_y + offset_y) % size;
+
+				float2 shift{ blue_noise[x + y * size], blue_noise[(x + size / 2) % size + ((y + size / 2) % size) * size] };
+				float2 point = get_sobol(sampling::hash_combine(seed, current_dimension)) + shift;
+				return point - floor(point);
+			}
+		}
+
+		return float2{ 0.f };
+	}
+} // namespace cg::renderer
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <linalg.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define CG_TRIANGLE_PACKET_SSE
+#include <emmintrin.h>
+#endif
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	constexpr size_t packet_width = 4;
+
+	// A ray broadcast to every lane of a packet, set up once per traversal
+	struct packet_ray
+	{
+		packet_ray(float3 position, float3 direction);
+
+#ifdef CG_TRIANGLE_PACKET_SSE
+		__m128 position[3];
+		__m128 direction[3];
+#else
+		float3 position;
+		float3 direction;
+#endif
+	};
+
+	// Four triangles with their coordinates laid out by lane, so that one ray is tested against all
+	// of them at once. Unused lanes are degenerate triangles that no ray hits
+	struct alignas(16) triangle_packet
+	{
+		float a[3][packet_width] = {};
+		float ba[3][packet_width] = {};
+		float ca[3][packet_width] = {};
+
+		void set_triangle(size_t lane, float3 in_a, float3 in_ba, float3 in_ca);
+		float3 get_a(size_t lane) const;
+		float3 get_ba(size_t lane) const;
+		float3 get_ca(size_t lane) const;
+
+		// Moller-Trumbore test of the lanes [first_lane, end_lane). Returns the lane of the closest hit in
+		// [min_t, max_t), after narrowing `max_t` to it and writing its barycentrics, or -1 if none is hit
+		int intersect(const packet_ray& ray, size_t first_lane, size_t end_lane, float min_t, float& max_t, float& u, float& v) const;
+		// Whether any of the lanes [first_lane, end_lane) is hit within [min_t, max_t]
+		bool intersect_any(const packet_ray& ray, size_t first_lane, size_t end_lane, float min_t, float max_t) const;
+
+	protected:
+		static constexpr float tolerance = 1e-8f;
+
+#ifdef CG_TRIANGLE_PACKET_SSE
+		// Lane mask of the hits, their distances and barycentrics
+		int intersect_lanes(const packet_ray& ray, size_t first_lane, size_t end_lane, __m128& t, __m128& u, __m128& v) const;
+#endif
+	};
+
+#ifdef CG_TRIANGLE_PACKET_SSE
+	inline packet_ray::packet_ray(float3 in_position, float3 in_direction)
+	{
+		for (int axis = 0; axis < 3; axis++) {
+			position[axis] = _mm_set1_ps(in_position[axis]);
+			direction[axis] = _mm_set1_ps(in_direction[axis]);
+		}
+	}
+#else
+	inline packet_ray::packet_ray(float3 in_position, float3 in_direction) : position(in_position), direction(in_direction) {}
+#endif
+
+	inline void triangle_packet::set_triangle(size_t lane, float3 in_a, float3 in_ba, float3 in_ca)
+	{
+		for (int axis = 0; axis < 3; axis++) {
+			a[axis][lane] = in_a[axis];
+			ba[axis][lane] = in_ba[axis];
+			ca[axis][lane] = in_ca[axis];
+		}
+	}
+
+	inline float3 triangle_packet::get_a(size_t lane) const { return float3{ a[0][lane], a[1][lane], a[2][lane] }; }
+
+	inline float3 triangle_packet::get_ba(size_t lane) const { return float3{ ba[0][lane], ba[1][lane], ba[2][lane] }; }
+
+	inline float3 triangle_packet::get_ca(size_t lane) const { return float3{ ca[0][lane], ca[1][lane], ca[2][lane] }; }
+
+#ifdef CG_TRIANGLE_PACKET_SSE
+	// The same operations in the same order as the scalar test, lane by lane
+	inline int triangle_packet::intersect_lanes(const packet_ray& ray, size_t first_lane, size_t end_lane, __m128& t, __m128& u, __m128& v) const
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		__m128 ba_x = _mm_load_ps(ba[0]), ba_y = _mm_load_ps(ba[1]), ba_z = _mm_load_ps(ba[2]);
+		__m128 ca_x = _mm_load_ps(ca[0]), ca_y = _mm_load_ps(ca[1]), ca_z = _mm_load_ps(ca[2]);
+		const __m128* d = ray.direction;
+
+		__m128 pvec_x = _mm_sub_ps(_mm_mul_ps(d[1], ca_z), _mm_mul_ps(d[2], ca_y));
+		__m128 pvec_y = _mm_sub_ps(_mm_mul_ps(d[2], ca_x), _mm_mul_ps(d[0], ca_z));
+		__m128 pvec_z = _mm_sub_ps(_mm_mul_ps(d[0], ca_y), _mm_mul_ps(d[1], ca_x));
+		__m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pvec_x, ba_x), _mm_mul_ps(pvec_y, ba_y)), _mm_mul_ps(pvec_z, ba_z));
+		__m128 valid = _mm_cmpge_ps(_mm_and_ps(determinant, sign_mask), _mm_set1_ps(tolerance));
+		__m128 inv_det = _mm_div_ps(one, determinant);
+
+		__m128 tvec_x = _mm_sub_ps(ray.position[0], _mm_load_ps(a[0]));
+		__m128 tvec_y = _mm_sub_ps(ray.position[1], _mm_load_ps(a[1]));
+		__m128 tvec_z = _mm_sub_ps(ray.position[2], _mm_load_ps(a[2]));
+		u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvec_x, pvec_x), _mm_mul_ps(tvec_y, pvec_y)), _mm_mul_ps(tvec_z, pvec_z)), inv_det);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+		__m128 qvec_x = _mm_sub_ps(_mm_mul_ps(tvec_y, ba_z), _mm_mul_ps(tvec_z, ba_y));
+		__m128 qvec_y = _mm_sub_ps(_mm_mul_ps(tvec_z, ba_x), _mm_mul_ps(tvec_x, ba_z));
+		__m128 qvec_z = _mm_sub_ps(_mm_mul_ps(tvec_x, ba_y), _mm_mul_ps(tvec_y, ba_x));
+		v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qvec_x), _mm_mul_ps(d[1], qvec_y)), _mm_mul_ps(d[2], qvec_z)), inv_det);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(v, u), one)));
+		t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ca_x, qvec_x), _mm_mul_ps(ca_y, qvec_y)), _mm_mul_ps(ca_z, qvec_z)), inv_det);
+
+		int lanes = ((1 << end_lane) - 1) & ~((1 << first_lane) - 1);
+		return _mm_movemask_ps(valid) & lanes;
+	}
+
+	inline int triangle_packet::intersect(const packet_ray& ray, size_t first_lane, size_t end_lane, float min_t, float& max_t, float& u, float& v) const
+	{
+		__m128 t_lanes, u_lanes, v_lanes;
+		int mask = intersect_lanes(ray, first_lane, end_lane, t_lanes, u_lanes, v_lanes);
+		mask &= _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(t_lanes, _mm_set1_ps(min_t)), _mm_cmplt_ps(t_lanes, _mm_set1_ps(max_t))));
+		if (mask == 0) return -1;
+
+		alignas(16) float t_values[packet_width], u_values[packet_width], v_values[packet_width];
+		_mm_store_ps(t_values, t_lanes);
+		_mm_store_ps(u_values, u_lanes);
+		_mm_store_ps(v_values, v_lanes);
+		int closest_lane = -1;
+		for (int lane = 0; lane < static_cast<int>(packet_width); lane++) {
+			if (!(mask & (1 << lane)) || t_values[lane] >= max_t) continue;
+			closest_lane = lane;
+			max_t = t_values[lane];
+		}
+		u = u_values[closest_lane];
+		v = v_values[closest_lane];
+		return closest_lane;
+	}
+
+	inline bool triangle_packet::intersect_any(const packet_ray& ray, size_t first_lane, size_t end_lane, float min_t, float max_t) const
+	{
+		__m128 t_lanes, u_lanes, v_lanes;
+		int mask = intersect_lanes(ray, first_lane, end_lane, t_lanes, u_lanes, v_lanes);
+		return (mask & _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(t_lanes, _mm_set1_ps(min_t)), _mm_cmple_ps(t_lanes, _mm_set1_ps(max_t))))) != 0;
+	}
+#else
+	inline int triangle_packet::intersect(const packet_ray& ray, size_t first_lane, size_t end_lane, float min_t, float& max_t, float& u, float& v) const
+	{
+		int closest_lane = -1;
+		for (size_t lane = first_lane; lane < end_lane; lane++) {
+			float3 lane_ba = get_ba(lane), lane_ca = get_ca(lane);
+			float3 pvec = cross(ray.direction, lane_ca);
+			float determinant = dot(pvec, lane_ba);
+			if (std::abs(determinant) < tolerance) continue;
+			float inv_det = 1 / determinant;
+
+			float3 tvec = ray.position - get_a(lane);
+			float lane_u = dot(tvec, pvec) * inv_det;
+			if (lane_u < 0 || lane_u > 1) continue;
+			float3 qvec = cross(tvec, lane_ba);
+			float lane_v = dot(ray.direction, qvec) * inv_det;
+			if (lane_v < 0 || lane_v + lane_u > 1) continue;
+			float t = dot(lane_ca, qvec) * inv_det;
+			if (t < min_t || t >= max_t) continue;
+
+			closest_lane = static_cast<int>(lane);
+			max_t = t;
+			u = lane_u;
+			v = lane_v;
+		}
+		return closest_lane;
+	}
+
+	inline bool triangle_packet::intersect_any(const packet_ray& ray, size_t first_lane, size_t end_lane, float min_t, float max_t) const
+	{
+		for (size_t lane = first_lane; lane < end_lane; lane++) {
+			float3 lane_ba = get_ba(lane), lane_ca = get_ca(lane);
+			float3 pvec = cross(ray.direction, lane_ca);
+			float determinant = dot(pvec, lane_ba);
+			if (std::abs(determinant) < tolerance) continue;
+			float inv_det = 1 / determinant;
+
+			float3 tvec = ray.position - get_a(lane);
+			float u = dot(tvec, pvec) * inv_det;
+			if (u < 0 || u > 1) continue;
+			float3 qvec = cross(tvec, lane_ba);
+			float t = dot(lane_ca, qvec) * inv_det;
+			if (t < min_t || t > max_t) continue;
+			float v = dot(ray.direction, qvec) * inv_det;
+			if (v >= 0 && v + u <= 1) return true;
+		}
+		return false;
+	}
+#endif
+} // namespace cg::renderer
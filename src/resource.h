@@ -76,4 +76,18 @@ namespace cg
 		fcolor emissive;
 	};
 
+	// A run of neighbouring triangles of a mesh, culled as a whole before any of its vertices is transformed.
+	// The bounding sphere and the normal cone are in the object space of the mesh
+	struct cluster
+	{
+		unsigned int first_index;
+		unsigned int index_count;
+		float3 center;
+		float radius;
+		// Every face normal is within the angle of `cone_axis` whose sine is `cone_sine`, a sine of one
+		// leaving the cluster facing every way
+		float3 cone_axis;
+		float cone_sine;
+	};
+
 } // namespace cg
\ No newline at end of file
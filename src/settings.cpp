@@ -25,13 +25,42 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("camera_z_near", "(rasterization only) Minimum expected depth", cxxopts::value<float>()->default_value("0.001"));
 	add_options("camera_z_far", "(rasterization only) Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
 	add_options("disable_depth", "(rasterization only) Disables depth buffer", cxxopts::value<bool>()->default_value("false"));
+	add_options("visibility_buffer", "(rasterization only) Rasterizes the visible triangles first and shades every pixel once in a separate pass", cxxopts::value<bool>()->default_value("false"));
+	add_options("occlusion_culling", "(rasterization only) Skips the clusters hidden behind the large ones in view, tested against a low resolution depth pyramid of those", cxxopts::value<bool>()->default_value("false"));
+	add_options("depth_only", "(rasterization only) Only renders the depth, from the positions alone, and only saves it to the depth export path", cxxopts::value<bool>()->default_value("false"));
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	// apparently empty default value is illegal in this library 
 	add_options("depth_export_path", "(rasterization only) Exports the raw depth map as a binary file", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("linear_depth_export_path", "(rasterization only) Exports the distance along the view direction as a PFM file, from the same pass as the result", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("normal_export_path", "(rasterization only) Exports the world space normals as a PFM file, from the same pass as the result", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("uv_export_path", "(rasterization only) Exports the texture coordinates as a PFM file, from the same pass as the result", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("id_export_path", "(rasterization only) Exports the draw and the triangle of every pixel as a PFM file, from the same pass as the result, -1 where nothing is drawn. Ids are exact up to 2^24", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("hdr_export_path", "(raytracing only) Exports the linear HDR result as a PFM file", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("checkpoint_path", "(raytracing only) Saves the accumulated samples to this file, periodically and at the end", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
+	add_options("checkpoint_interval", "(raytracing only) Seconds between checkpoints, 0 only saves at the end", cxxopts::value<float>()->default_value("60"));
+	add_options("resume", "(raytracing only) Continues accumulation from the checkpoint file", cxxopts::value<bool>()->default_value("false"));
+	add_options("bvh_cache_path", "(raytracing only) Folder for built acceleration structures, that later runs on the same model map instead of building", cxxopts::value<std::filesystem::path>()->default_value("~~~~~~~~~~"));
 	add_options("nodisplay", "Disables resulting image display", cxxopts::value<bool>()->default_value("false"));
 	add_options("use_fov", "(raytracing only) Takes user-defined camera FOV into account", cxxopts::value<bool>()->default_value("false"));
 	add_options("raytracing_depth", "(raytracing only) Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "(raytracing only) Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("sampler", "(raytracing only) Sample generator: random, sobol or blue_noise", cxxopts::value<std::string>()->default_value("sobol"));
+	add_options("seed", "(raytracing only) Seed of the sample generator", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("tile_size", "(raytracing only) Side of the square tiles scheduled between threads", cxxopts::value<unsigned>()->default_value("16"));
+	add_options("crop", "(raytracing only) Only traces the x,y,width,height rectangle of the image, zeros trace everything", cxxopts::value<std::vector<unsigned>>()->default_value("0,0,0,0"));
+	add_options("sample_offset", "(raytracing only) Index of the first sample of every pixel, so that processes can split the samples", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("adaptive_threshold", "(raytracing only) Stops sampling a pixel once the error of its displayed value at 95% confidence is below this, 0 disables", cxxopts::value<float>()->default_value("0"));
+	add_options("error_target", "(raytracing only) Stops rendering once the average error of the displayed values is below this, 0 disables", cxxopts::value<float>()->default_value("0"));
+	add_options("time_budget", "(raytracing only) Stops rendering after this many seconds, 0 disables", cxxopts::value<float>()->default_value("0"));
+	add_options("instance_grid", "Places the model N times along x and N times along z, every copy instancing the same geometry", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("animation_frames", "(raytracing only) Renders this many frames of the instance grid bobbing up and down, numbered after the result path", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("deform_meshes", "(raytracing only) Also ripples the vertices of the model over the animation, refitting or rebuilding the hierarchies of its meshes every frame", cxxopts::value<bool>()->default_value("false"));
+	add_options("bvh_builder", "(raytracing only) Builder of the hierarchies: sah, sbvh to also split long triangles, or lbvh to build fast", cxxopts::value<std::string>()->default_value("sah"));
+	add_options("sbvh_budget", "(raytracing only) Triangle references the sbvh builder may make per triangle", cxxopts::value<float>()->default_value("1.3"));
+	add_options("quantize_bvh", "(raytracing only) Stores the boxes of the hierarchies in 8 bits per plane, for a third of the memory", cxxopts::value<bool>()->default_value("false"));
+	add_options("wavefront", "(raytracing only) Traces all paths bounce by bounce through sorted ray queues", cxxopts::value<bool>()->default_value("false"));
+	add_options("denoise", "(raytracing only) Filters the result with an edge-avoiding a-trous denoiser guided by albedo, normal and depth", cxxopts::value<bool>()->default_value("false"));
+	add_options("hybrid", "(raytracing only) Rasterizes the first hits of the camera rays and only traces the bounces", cxxopts::value<bool>()->default_value("false"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -51,13 +80,62 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->camera_z_near = result["camera_z_near"].as<float>();
 	settings->camera_z_far = result["camera_z_far"].as<float>();
 	settings->disable_depth = result["disable_depth"].as<bool>();
+	settings->visibility_buffer = result["visibility_buffer"].as<bool>();
+	settings->occlusion_culling = result["occlusion_culling"].as<bool>();
+	settings->depth_only = result["depth_only"].as<bool>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->depth_result_path = result["depth_export_path"].as<std::filesystem::path>();
 	if (settings->depth_result_path == "~~~~~~~~~~") settings->depth_result_path = "";
+	settings->linear_depth_result_path = result["linear_depth_export_path"].as<std::filesystem::path>();
+	if (settings->linear_depth_result_path == "~~~~~~~~~~") settings->linear_depth_result_path = "";
+	settings->normal_result_path = result["normal_export_path"].as<std::filesystem::path>();
+	if (settings->normal_result_path == "~~~~~~~~~~") settings->normal_result_path = "";
+	settings->uv_result_path = result["uv_export_path"].as<std::filesystem::path>();
+	if (settings->uv_result_path == "~~~~~~~~~~") settings->uv_result_path = "";
+	settings->id_result_path = result["id_export_path"].as<std::filesystem::path>();
+	if (settings->id_result_path == "~~~~~~~~~~") settings->id_result_path = "";
+	if (settings->depth_only) {
+		if (settings->depth_result_path.empty() || settings->disable_depth) THROW_ERROR("Depth only rendering needs the depth buffer and a depth export path");
+		if (settings->visibility_buffer || !settings->linear_depth_result_path.empty() || !settings->normal_result_path.empty() || !settings->uv_result_path.empty() || !settings->id_result_path.empty())
+			THROW_ERROR("Depth only rendering can't shade a visibility buffer or the extra outputs");
+	}
+	settings->hdr_result_path = result["hdr_export_path"].as<std::filesystem::path>();
+	if (settings->hdr_result_path == "~~~~~~~~~~") settings->hdr_result_path = "";
+	settings->checkpoint_path = result["checkpoint_path"].as<std::filesystem::path>();
+	if (settings->checkpoint_path == "~~~~~~~~~~") settings->checkpoint_path = "";
+	settings->bvh_cache_path = result["bvh_cache_path"].as<std::filesystem::path>();
+	if (settings->bvh_cache_path == "~~~~~~~~~~") settings->bvh_cache_path = "";
+	settings->raytracing_checkpoint_interval = result["checkpoint_interval"].as<float>();
+	settings->raytracing_resume = result["resume"].as<bool>();
+	if (settings->raytracing_resume && settings->checkpoint_path.empty()) THROW_ERROR("Resuming needs a checkpoint path");
 	settings->show_render = !result["nodisplay"].as<bool>();
 	settings->raytracing_use_fov = result["use_fov"].as<bool>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->raytracing_sampler = result["sampler"].as<std::string>();
+	settings->raytracing_seed = result["seed"].as<unsigned>();
+	settings->raytracing_wavefront = result["wavefront"].as<bool>();
+	settings->raytracing_denoise = result["denoise"].as<bool>();
+	settings->raytracing_hybrid = result["hybrid"].as<bool>();
+	settings->raytracing_tile_size = result["tile_size"].as<unsigned>();
+	if (settings->raytracing_tile_size == 0) THROW_ERROR("Tile size must be positive");
+	settings->raytracing_crop = result["crop"].as<std::vector<unsigned>>();
+	if (settings->raytracing_crop.size() != 4) THROW_ERROR("Crop must be given as x,y,width,height");
+	settings->raytracing_sample_offset = result["sample_offset"].as<unsigned>();
+	settings->raytracing_adaptive_threshold = result["adaptive_threshold"].as<float>();
+	settings->raytracing_error_target = result["error_target"].as<float>();
+	settings->raytracing_time_budget = result["time_budget"].as<float>();
+	settings->instance_grid = result["instance_grid"].as<unsigned>();
+	if (settings->instance_grid == 0) THROW_ERROR("Instance grid must be positive");
+	settings->raytracing_bvh_builder = result["bvh_builder"].as<std::string>();
+	settings->raytracing_sbvh_budget = result["sbvh_budget"].as<float>();
+	if (settings->raytracing_sbvh_budget < 1) THROW_ERROR("The SBVH budget can't be below one reference per triangle");
+	settings->raytracing_quantize_bvh = result["quantize_bvh"].as<bool>();
+	settings->animation_frames = result["animation_frames"].as<unsigned>();
+	if (settings->animation_frames == 0) THROW_ERROR("Animation must have at least one frame");
+	if (settings->animation_frames > 1 && !settings->checkpoint_path.empty()) THROW_ERROR("Animations can't be checkpointed");
+	settings->deform_meshes = result["deform_meshes"].as<bool>();
+	if (settings->deform_meshes && !settings->bvh_cache_path.empty()) THROW_ERROR("Meshes mapped from a BVH cache can't be deformed");
 
 	const cxxopts::OptionNames& extras = result.unmatched();
 	for (size_t i = 0; i < extras.size(); i++) {
@@ -24,14 +24,43 @@ namespace cg
 		float camera_z_near;
 		float camera_z_far;
 		bool disable_depth;
+		bool visibility_buffer;
+		bool occlusion_culling;
+		bool depth_only;
 		bool show_render;
 		bool raytracing_use_fov;
+		bool raytracing_wavefront;
+		bool raytracing_denoise;
+		bool raytracing_hybrid;
+		bool raytracing_resume;
 
 		std::filesystem::path result_path;
 		std::filesystem::path depth_result_path;
+		std::filesystem::path linear_depth_result_path;
+		std::filesystem::path normal_result_path;
+		std::filesystem::path uv_result_path;
+		std::filesystem::path id_result_path;
+		std::filesystem::path hdr_result_path;
+		std::filesystem::path checkpoint_path;
+		std::filesystem::path bvh_cache_path;
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		std::string raytracing_sampler;
+		unsigned raytracing_seed;
+		unsigned raytracing_tile_size;
+		std::vector<unsigned> raytracing_crop;
+		unsigned raytracing_sample_offset;
+		float raytracing_adaptive_threshold;
+		float raytracing_error_target;
+		float raytracing_time_budget;
+		float raytracing_checkpoint_interval;
+		std::string raytracing_bvh_builder;
+		float raytracing_sbvh_budget;
+		bool raytracing_quantize_bvh;
+		unsigned instance_grid;
+		unsigned animation_frames;
+		bool deform_meshes;
 
 		std::unordered_map<std::string, std::string> extra_options;
 	};
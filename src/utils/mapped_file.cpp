@@ -0,0 +1,68 @@
+#include "mapped_file.h"
+
+#include "utils/error_handler.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+cg::utils::mapped_file::mapped_file(const std::filesystem::path& filepath) {
+	file_handle = CreateFileW(filepath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE) THROW_ERROR("Can't open the file for mapping: " + filepath.string());
+
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file_handle, &file_size);
+	size = static_cast<size_t>(file_size.QuadPart);
+	if (size == 0) return;
+
+	mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_handle) data = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+	if (!data) {
+		if (mapping_handle) CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+		THROW_ERROR("Can't map the file: " + filepath.string());
+	}
+}
+
+cg::utils::mapped_file::~mapped_file() {
+	if (data) UnmapViewOfFile(data);
+	if (mapping_handle) CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+}
+#else
+cg::utils::mapped_file::mapped_file(const std::filesystem::path& filepath) {
+	int file = open(filepath.c_str(), O_RDONLY);
+	if (file < 0) THROW_ERROR("Can't open the file for mapping: " + filepath.string());
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0) {
+		close(file);
+		THROW_ERROR("Can't read the size of the file for mapping: " + filepath.string());
+	}
+	size = static_cast<size_t>(file_stat.st_size);
+	if (size == 0) {
+		close(file);
+		return;
+	}
+
+	void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	// The mapping keeps its own reference to the file
+	close(file);
+	if (mapping == MAP_FAILED) THROW_ERROR("Can't map the file: " + filepath.string());
+	data = static_cast<const char*>(mapping);
+}
+
+cg::utils::mapped_file::~mapped_file() {
+	if (data) munmap(const_cast<char*>(data), size);
+}
+#endif
+
+const char* cg::utils::mapped_file::get_data() const { return data; }
+
+size_t cg::utils::mapped_file::get_size() const { return size; }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+
+namespace cg::utils
+{
+	// Read-only view of a whole file mapped into memory. Pages are loaded by the OS on first access,
+	// so opening a large file costs next to nothing
+	class mapped_file
+	{
+	public:
+		explicit mapped_file(const std::filesystem::path& filepath);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		const char* get_data() const;
+		size_t get_size() const;
+
+	protected:
+		const char* data = nullptr;
+		size_t size = 0;
+#ifdef _WIN32
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+#endif
+	};
+}// namespace cg::utils
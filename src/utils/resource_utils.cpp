@@ -52,3 +52,21 @@ void cg::utils::save_resource(cg::resource<float>& depth_buffer, const std::file
     
     fs.close();
 }
+
+// Portable float map: a text header, then little-endian RGB floats from the bottom row up
+void cg::utils::save_resource(cg::resource<cg::fcolor>& hdr_target, const std::filesystem::path& filepath)
+{
+	size_t width = hdr_target.get_stride();
+	size_t height = hdr_target.get_number_of_elements() / width;
+
+	std::ofstream fs(filepath, std::ios::out | std::ios::binary);
+	if (!fs)
+		THROW_ERROR("Can't save the resource");
+
+	fs << "PF\n" << width << " " << height << "\n-1.0\n";
+	for (size_t y = height; y-- > 0;) {
+		fs.write(reinterpret_cast<const char*>(&hdr_target.item(0, y)), width * sizeof(cg::fcolor));
+	}
+
+	fs.close();
+}
@@ -20,4 +20,5 @@ namespace cg::utils
 
 	void save_resource(cg::resource<cg::ucolor>& render_target, const std::filesystem::path& filepath);
 	void save_resource(cg::resource<float>& depth_buffer, const std::filesystem::path& filepath);
+	void save_resource(cg::resource<cg::fcolor>& hdr_target, const std::filesystem::path& filepath);
 }
\ No newline at end of file
@@ -3,8 +3,12 @@
 #include "model.h"
 
 #include "utils/error_handler.h"
+#include "utils/hash.h"
 
+#include <cmath>
+#include <fstream>
 #include <linalg.h>
+#include <sstream>
 
 
 using namespace linalg::aliases;
@@ -36,6 +40,37 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 		reader.GetMaterials(), 
 		model_path.parent_path()
 	);
+	build_clusters();
+}
+
+uint64_t model::get_file_hash(const std::filesystem::path& model_path)
+{
+	auto read_file = [](const std::filesystem::path& path) {
+		std::ifstream fs(path, std::ios::in | std::ios::binary);
+		if (!fs) THROW_ERROR("Can't open " + path.string());
+		std::stringstream contents;
+		contents << fs.rdbuf();
+		return contents.str();
+	};
+
+	std::string obj = read_file(model_path);
+	uint64_t hash = cg::utils::hash_bytes(obj.data(), obj.size());
+
+	std::istringstream lines(obj);
+	std::string line;
+	while (std::getline(lines, line)) {
+		if (line.rfind("mtllib", 0) != 0) continue;
+		std::istringstream libraries(line.substr(6));
+		std::string library;
+		while (libraries >> library) {
+			std::filesystem::path library_path = model_path.parent_path() / library;
+			if (std::filesystem::exists(library_path)) {
+				std::string mtl = read_file(library_path);
+				hash = cg::utils::hash_bytes(mtl.data(), mtl.size(), hash);
+			}
+		}
+	}
+	return hash;
 }
 
 void model::allocate_buffers(const std::vector<tinyobj::shape_t>& shapes)
@@ -142,6 +177,71 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 	}
 }
 
+// Cuts the triangles of every shape, in the order of its index buffer, into clusters of up to
+// `max_triangles`. Past `min_triangles` a cluster also ends where the next triangle shares no vertex
+// with its last one, as faces are mostly listed patch by patch
+void model::build_clusters()
+{
+	constexpr unsigned int min_triangles = 64;
+	constexpr unsigned int max_triangles = 128;
+
+	clusters.assign(index_buffers.size(), {});
+	for (size_t s = 0; s < index_buffers.size(); s++) {
+		auto& index_buffer = *index_buffers[s];
+		unsigned int index_count = static_cast<unsigned int>(index_buffer.get_number_of_elements());
+		unsigned int first_index = 0;
+		for (unsigned int index = 3; index <= index_count; index += 3) {
+			unsigned int triangles = (index - first_index) / 3;
+			bool is_connected = false;
+			if (index < index_count) {
+				for (unsigned int i = index - 3; i < index; i++) {
+					for (unsigned int j = index; j < index + 3; j++) is_connected = is_connected || index_buffer.item(i) == index_buffer.item(j);
+				}
+			}
+			if (index < index_count && triangles < max_triangles && (triangles < min_triangles || is_connected)) continue;
+
+			clusters[s].push_back(make_cluster(*vertex_buffers[s], index_buffer, first_index, index - first_index));
+			first_index = index;
+		}
+	}
+}
+
+cg::cluster model::make_cluster(cg::resource<cg::vertex>& vertex_buffer, cg::resource<unsigned int>& index_buffer, unsigned int first_index, unsigned int index_count)
+{
+	auto get_position = [&](unsigned int index) {
+		return vertex_buffer.item(index_buffer.item(index)).pos.xyz();
+	};
+
+	cg::cluster cluster {};
+	cluster.first_index = first_index;
+	cluster.index_count = index_count;
+	float3 bounds_min = get_position(first_index);
+	float3 bounds_max = bounds_min;
+	for (unsigned int i = first_index; i < first_index + index_count; i++) {
+		bounds_min = min(bounds_min, get_position(i));
+		bounds_max = max(bounds_max, get_position(i));
+	}
+	cluster.center = (bounds_min + bounds_max) / 2;
+	cluster.radius = 0.f;
+	for (unsigned int i = first_index; i < first_index + index_count; i++) cluster.radius = std::max(cluster.radius, length(get_position(i) - cluster.center));
+
+	// The axis is the mean of the face normals, and the cone is as wide as the normal furthest from it
+	std::vector<float3> normals;
+	float3 normal_sum { 0.f };
+	for (unsigned int i = first_index; i < first_index + index_count; i += 3) {
+		float3 a = get_position(i);
+		float3 normal = cross(get_position(i + 1) - a, get_position(i + 2) - a);
+		if (length(normal) == 0) continue;
+		normals.push_back(normalize(normal));
+		normal_sum += normals.back();
+	}
+	cluster.cone_axis = length(normal_sum) > 0 ? normalize(normal_sum) : float3{ 0.f, 0.f, 1.f };
+	float min_cosine = normals.empty() ? -1.f : 1.f;
+	for (const float3& normal : normals) min_cosine = std::min(min_cosine, dot(normal, cluster.cone_axis));
+	cluster.cone_sine = min_cosine > 0 ? std::sqrt(1 - min_cosine * min_cosine) : 1.f;
+	return cluster;
+}
+
 const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>&
 cg::world::model::get_vertex_buffers() const { return vertex_buffers; }
 
@@ -150,6 +250,8 @@ cg::world::model::get_index_buffers() const { return index_buffers; }
 
 const std::vector<std::filesystem::path>& cg::world::model::get_per_shape_texture_files() const { return textures; }
 
+const std::vector<std::vector<cg::cluster>>& cg::world::model::get_clusters() const { return clusters; }
+
 const float4x4 cg::world::model::get_world_matrix() const {
 	return float4x4 {
 		{1, 0, 0, 0},
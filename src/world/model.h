@@ -19,10 +19,15 @@ namespace cg::world
 		virtual ~model();
 
 		void load_obj(const std::filesystem::path& model_path);
+		// Hash of the OBJ file and of the material libraries it references, to recognize a model
+		// without parsing it
+		static uint64_t get_file_hash(const std::filesystem::path& model_path);
 
 		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
 		const std::vector<std::filesystem::path>& get_per_shape_texture_files() const;
+		// The clusters of every shape, covering its index buffer in order
+		const std::vector<std::vector<cg::cluster>>& get_clusters() const;
 
 		const float4x4 get_world_matrix() const;
 
@@ -31,10 +36,13 @@ namespace cg::world
 		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::filesystem::path> textures;
+		std::vector<std::vector<cg::cluster>> clusters;
 
 		void allocate_buffers(const std::vector<tinyobj::shape_t>& shapes);
 		static float3 compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset);
 		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, tinyobj::material_t material);
 		void fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder);
+		void build_clusters();
+		static cg::cluster make_cluster(cg::resource<cg::vertex>& vertex_buffer, cg::resource<unsigned int>& index_buffer, unsigned int first_index, unsigned int index_count);
 	};
 }// namespace cg::world
\ No newline at end of file